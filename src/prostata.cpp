@@ -25,6 +25,16 @@
 #include <microsimulation.h>
 
 #include <boost/algorithm/cxx11/iota.hpp>
+#include <boost/cstdint.hpp>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#include <sys/time.h> // also in MinGW
+#endif
 
 namespace fhcrc_example {
 
@@ -54,6 +64,9 @@ namespace fhcrc_example {
                 toSTHLM3, toOpportunistic, toT3plus, toCancelScreens,
                 toYearlyActiveSurveillance, toYearlyPostTxFollowUp};
 
+  /** Bit for an event kind, for sets of kinds in EventQueue::RemoveKinds() */
+  inline unsigned long kind_bit(short kind) { return 1UL << kind; }
+
   enum screen_t {noScreening, randomScreen50to70, twoYearlyScreen50to70, fourYearlyScreen50to70,
 		 screen50, screen60, screen70, screenUptake, stockholm3_goteborg, stockholm3_risk_stratified,
 		 goteborg, risk_stratified, mixed_screening, regular_screen, single_screen,
@@ -69,15 +82,132 @@ namespace fhcrc_example {
 
   enum utility_scale_t {UtilityAdditive, UtilityMultiplicative, UtilityMinimum};
 
+  enum stream_t {NhStream, OtherStream, ScreenStream, TreatmentStream};
+
   namespace FullState {
     typedef boost::tuple<short,short,short,bool,double> Type;
     enum Fields {ext_state, ext_grade, dx, psa_ge_3, cohort};
     // string names[5] = {"ext_state","ext_grade","dx","psa_ge_3","cohort"};
+    enum {NExtState = 4, NExtGrade = 4, NDx = 3};
+    /**
+       @brief Packs a full state into a code in 0, ..., size()-1, in the
+       same order as the tuples. The cohorts are the sorted unique
+       cohorts of the simulation.
+    */
+    class Codes {
+    public:
+      vector<double> cohorts;
+      Codes() {}
+      Codes(const double* first, const double* last) : cohorts(first, last) {
+	sort(cohorts.begin(), cohorts.end());
+	cohorts.erase(unique(cohorts.begin(), cohorts.end()), cohorts.end());
+      }
+      int size() const { return NExtState * NExtGrade * NDx * 2 * int(cohorts.size()); }
+      int code(short ext_state, short ext_grade, short dx, bool psa_ge_3, double cohort) const {
+	int c = int(lower_bound(cohorts.begin(), cohorts.end(), cohort) - cohorts.begin());
+	return (((ext_state * NExtGrade + ext_grade) * NDx + dx) * 2 + int(psa_ge_3)) * int(cohorts.size()) + c;
+      }
+      /** The key columns for the given codes */
+      List columns(const vector<int>& codes) const {
+	int ncohorts = cohorts.size();
+	vector<int> ext_states, ext_grades, dxs;
+	vector<bool> psa_ge_3s;
+	vector<double> cohort_values;
+	for (size_t i = 0; i < codes.size(); ++i) {
+	  int code = codes[i];
+	  cohort_values.push_back(cohorts[code % ncohorts]); code /= ncohorts;
+	  psa_ge_3s.push_back(code % 2 == 1); code /= 2;
+	  dxs.push_back(code % NDx); code /= NDx;
+	  ext_grades.push_back(code % NExtGrade); code /= NExtGrade;
+	  ext_states.push_back(code);
+	}
+	return List::create(_("ext_state") = Rcpp::wrap(ext_states),
+			    _("ext_grade") = Rcpp::wrap(ext_grades),
+			    _("dx") = Rcpp::wrap(dxs),
+			    _("psa_ge_3") = Rcpp::wrap(psa_ge_3s),
+			    _("cohort") = Rcpp::wrap(cohort_values));
+      }
+    };
   }
+  /** Key columns of a report keyed directly by integer state */
+  struct IntegerCodes {
+    List columns(const vector<int>& codes) const {
+      return List::create(_("state") = Rcpp::wrap(codes));
+    }
+  };
   namespace LifeHistory {
     typedef boost::tuple<int, short, short, int, short, double, double, double, double, double> Type;
     enum Fields {id, ext_state, ext_grade, dx, event, begin, end, year, psa, utility};
   }
+  /**
+     Columns of the records in SimOutput (see RecordReport)
+  */
+  namespace ParameterRecord {
+    enum Fields {id, beta0, beta1, beta2, t0, tm, tc, tmc, y0, ym, aoc, cohort,
+      future_ext_grade, ext_grade, age_psa, age_pca, pca_death, psa55, psa65,
+      psa75, psa85, rescreening_frailty, age_d, N};
+    const char* names[N] = {"id", "beta0", "beta1", "beta2", "t0", "tm", "tc",
+      "tmc", "y0", "ym", "aoc", "cohort", "future_ext_grade", "ext_grade",
+      "age_psa", "age_pca", "pca_death", "psa55", "psa65", "psa75", "psa85",
+      "rescreening_frailty", "age_d"};
+  }
+  namespace PsaRecord {
+    enum Fields {id, state, ext_grade, organised, dx, age, cohort, psa, t0,
+      beta0, beta1, beta2, Z, onset, detectable, N};
+    const char* names[N] = {"id", "state", "ext_grade", "organised", "dx",
+      "age", "cohort", "psa", "t0", "beta0", "beta1", "beta2", "Z", "onset",
+      "detectable"};
+  }
+  namespace BxRecord {
+    enum Fields {id, state, ext_state, ext_grade, organised, dx, age, cohort,
+      psa, t0, beta0, beta1, beta2, Z, onset, detectable, N};
+    const char* names[N] = {"id", "state", "ext_state", "ext_grade",
+      "organised", "dx", "age", "cohort", "psa", "t0", "beta0", "beta1",
+      "beta2", "Z", "onset", "detectable"};
+  }
+  namespace FalsePositiveRecord {
+    enum Fields {id, psa, age, age0, ext_grade, N};
+    const char* names[N] = {"id", "psa", "age", "age0", "ext_grade"};
+  }
+  namespace DiagnosisRecord {
+    enum Fields {id, age, year, psa, ext_grade, ext_state, organised, dx, tx,
+      cancer_death, age_at_death, age_cancer_death, aoc, age_cd, age_sd,
+      weight, lead_time, N};
+    const char* names[N] = {"id", "age", "year", "psa", "ext_grade",
+      "ext_state", "organised", "dx", "tx", "cancer_death", "age_at_death",
+      "age_cancer_death", "aoc", "age_cd", "age_sd", "weight", "lead_time"};
+  }
+  /**
+     Outcomes per man for the precision targets: prostate cancer deaths per
+     1000 men, discounted QALYs and discounted health sector costs
+  */
+  namespace Outcome {
+    enum Type {pca_deaths, qalys, costs, N};
+    const char* names[N] = {"pca_deaths", "qalys", "costs"};
+  }
+  /**
+     Cost, productivity and utility categories, with the names used for
+     cost_parameters, lost_production_years, utility_estimates and
+     utility_duration in FhcrcParameters
+  */
+  namespace Category {
+    enum Type {Invitation, FormalPSA, FormalPanel, OpportunisticPSA,
+      OpportunisticPanel, Biopsy, Assessment, Prostatectomy,
+      RadiationTherapy, ActiveSurveillanceYearly, ActiveSurveillanceSingleMR,
+      PostTxFollowUpYearly, CancerDeath, MetastaticCancer, TerminalIllness,
+      CancerDiagnosis, ProstatectomyPart1, ProstatectomyPart2,
+      RadiationTherapyPart1, RadiationTherapyPart2, ActiveSurveillance,
+      PostrecoveryPeriod, PalliativeTherapy, Death, N};
+    const char* names[N] = {"Invitation", "Formal PSA", "Formal panel",
+      "Opportunistic PSA", "Opportunistic panel", "Biopsy", "Assessment",
+      "Prostatectomy", "Radiation therapy", "Active surveillance - yearly",
+      "Active surveillance - single MR", "Post-Tx follow-up - yearly",
+      "Cancer death", "Metastatic cancer", "Terminal illness",
+      "Cancer diagnosis", "Prostatectomy part 1", "Prostatectomy part 2",
+      "Radiation therapy part 1", "Radiation therapy part 2",
+      "Active surveillance", "Postrecovery period", "Palliative therapy",
+      "Death"};
+  }
 
   RcppExport SEXP rllogis_(SEXP shape, SEXP scale) {
     RNGScope scope;
@@ -88,18 +218,778 @@ namespace fhcrc_example {
     return wrap(R::rllogis_trunc(as<double>(shape),as<double>(scale),as<double>(left)));
   }
 
-  typedef std::pair<int,string> CostKey; // (cost_type,cost_name)
-  // typedef boost::tuple<int,string,double> CostKey; // (cost_type,cost_name,cohort)
+  /** Wall-clock time in seconds */
+  inline double wall_time() {
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+#endif
+  }
+
+  /**
+     @brief Optional profile of the event handling for one worker: events
+     handled, wall time in handleMessage and messages allocated by event
+     kind, time in init, and histograms of the number of events per man
+     and of the number of pending events.
+  */
+  class Profile {
+  public:
+    typedef map<long,long> Histogram;
+    vector<long> events, allocations; // by kind
+    vector<double> time; // by kind
+    long persons;
+    double initTime;
+    Histogram eventsPerPerson, queueSize;
+    Profile(int nkinds = 32) : events(nkinds, 0L), allocations(nkinds, 0L), time(nkinds, 0.0),
+			       persons(0L), initTime(0.0) {}
+    bool valid(short kind) const { return kind >= 0 && kind < short(events.size()); }
+    void clear() {
+      fill(events.begin(), events.end(), 0L);
+      fill(allocations.begin(), allocations.end(), 0L);
+      fill(time.begin(), time.end(), 0.0);
+      persons = 0L;
+      initTime = 0.0;
+      eventsPerPerson.clear();
+      queueSize.clear();
+    }
+    template<class Archive>
+    void checkpoint(Archive& ar) {
+      ar.io(events); ar.io(allocations); ar.io(time);
+      ar.io(persons); ar.io(initTime);
+      ar.io(eventsPerPerson); ar.io(queueSize);
+    }
+    void append(const Profile& other) {
+      for (size_t k = 0; k < events.size(); ++k) {
+	events[k] += other.events[k];
+	allocations[k] += other.allocations[k];
+	time[k] += other.time[k];
+      }
+      persons += other.persons;
+      initTime += other.initTime;
+      for (Histogram::const_iterator it = other.eventsPerPerson.begin(); it != other.eventsPerPerson.end(); ++it)
+	eventsPerPerson[it->first] += it->second;
+      for (Histogram::const_iterator it = other.queueSize.begin(); it != other.queueSize.end(); ++it)
+	queueSize[it->first] += it->second;
+    }
+    static List wrap(const Histogram& h) {
+      vector<double> x, n;
+      for (Histogram::const_iterator it = h.begin(); it != h.end(); ++it) {
+	x.push_back(double(it->first));
+	n.push_back(double(it->second));
+      }
+      return List::create(_("x") = Rcpp::wrap(x), _("n") = Rcpp::wrap(n));
+    }
+    SEXP wrap() {
+      vector<double> e(events.begin(), events.end()), a(allocations.begin(), allocations.end());
+      return List::create(_("events") = Rcpp::wrap(e),
+			  _("allocations") = Rcpp::wrap(a),
+			  _("time") = Rcpp::wrap(time),
+			  _("persons") = double(persons),
+			  _("initTime") = initTime,
+			  _("eventsPerPerson") = wrap(eventsPerPerson),
+			  _("queueSize") = wrap(queueSize));
+    }
+  };
+
+  /**
+     @brief Exact sum of doubles, as a 128-bit fixed-point number with 64
+     fractional bits.
+
+     Each term is truncated to a multiple of 2^-64, and the integer
+     additions do not depend on the order of the terms, so the workers'
+     sums can be merged in any order with the same result. Terms of 2^62
+     or more in magnitude, and non-finite terms, are added in a double.
+  */
+  class ExactSum {
+  public:
+    ExactSum() : hi(0), lo(0), special(0.0) {}
+    ExactSum& operator+=(double x) {
+      if (x == 0.0) return *this;
+      if (!(fabs(x) < 4611686018427387904.0)) { // 2^62, or not finite
+	special += x;
+	return *this;
+      }
+      int e;
+      boost::uint64_t m = boost::uint64_t(ldexp(frexp(fabs(x), &e), 53)); // |x| = m 2^(e-53)
+      int shift = e + 11; // x 2^64 = m 2^shift
+      boost::uint64_t h = 0, l = 0;
+      if (shift >= 64) h = m << (shift - 64);
+      else if (shift > 0) { h = m >> (64 - shift); l = m << shift; }
+      else if (shift > -64) l = m >> -shift;
+      else return *this; // below 2^-64
+      if (x < 0.0) { // two's complement
+	l = ~l + 1;
+	h = ~h + (l == 0 ? 1 : 0);
+      }
+      add(h, l);
+      return *this;
+    }
+    ExactSum& operator+=(const ExactSum& other) {
+      add(other.hi, other.lo);
+      special += other.special;
+      return *this;
+    }
+    double value() const {
+      return double(boost::int64_t(hi)) + ldexp(double(lo), -64) + special;
+    }
+  private:
+    boost::uint64_t hi, lo; // hi is signed in two's complement
+    double special;
+    void add(boost::uint64_t h, boost::uint64_t l) {
+      lo += l;
+      hi += h + (lo < l ? 1 : 0);
+    }
+  };
+
+  /**
+     @brief Costs by (cost_type, category, age), kept in a dense array.
+
+     This replaces CostReport<pair<int,string> >: the keys are only
+     rebuilt as strings in wrap(), which returns the same columns as
+     the CostReport (type, item, age, costs). The costs for a block of
+     men are added in table, then flush() adds them to the exact totals.
+  */
+  class CostAccumulator {
+  public:
+    double discountRate;
+    vector<double> partition; // ascending
+    vector<double> table; // current block
+    vector<ExactSum> totals;
+    vector<char> used;
+    double tableRate, alpha; // discount rate for alpha, and log(1+rate)
+    CostAccumulator(double discountRate = 0.0) : discountRate(discountRate), tableRate(0.0), alpha(0.0) {}
+    void setPartition(const vector<double>& v) {
+      partition = v;
+      tableRate = discountRate;
+      alpha = log(1.0 + discountRate);
+      sort(partition.begin(), partition.end());
+      table.assign(2 * Category::N * partition.size(), 0.0);
+      totals.assign(table.size(), ExactSum());
+      used.assign(table.size(), 0);
+    }
+    void clear() {
+      fill(table.begin(), table.end(), 0.0);
+      fill(totals.begin(), totals.end(), ExactSum());
+      fill(used.begin(), used.end(), 0);
+    }
+    /** Add the costs for the current block to the totals */
+    void flush() {
+      for (size_t i = 0; i < table.size(); ++i) {
+	totals[i] += table[i];
+	table[i] = 0.0;
+      }
+    }
+    size_t index(int cost_type, int category, int bucket) const {
+      return (cost_type * Category::N + category) * partition.size() + bucket;
+    }
+    void add(cost_t cost_type, Category::Type category, double time, double cost) {
+      int bucket = int(upper_bound(partition.begin(), partition.end(), time) - partition.begin()) - 1;
+      if (bucket < 0) bucket = 0;
+      size_t i = index(cost_type, category, bucket);
+      table[i] += discounted(time, cost);
+      used[i] = 1;
+    }
+    double discounted(double time, double cost) {
+      if (discountRate == 0.0) return cost;
+      if (tableRate != discountRate) {
+	tableRate = discountRate;
+	alpha = log(1.0 + discountRate);
+      }
+      return cost * exp(-alpha * time);
+    }
+    template<class Archive>
+    void checkpoint(Archive& ar) { ar.io(totals); ar.io(used); }
+    /** Add the totals from another accumulator with the same partition */
+    void append(const CostAccumulator& other) {
+      for (size_t i = 0; i < table.size(); ++i) {
+	totals[i] += other.totals[i];
+	used[i] = used[i] || other.used[i];
+      }
+    }
+    SEXP wrap() {
+      // categories in the same (alphabetical) order as the string keys
+      vector<pair<string,int> > order;
+      for (int k = 0; k < Category::N; ++k)
+	order.push_back(make_pair(string(Category::names[k]), k));
+      sort(order.begin(), order.end());
+      vector<int> type;
+      vector<string> item;
+      vector<double> age, costs;
+      for (int j = 0; j < 2; ++j)
+	for (size_t k = 0; k < order.size(); ++k)
+	  for (size_t bucket = 0; bucket < partition.size(); ++bucket) {
+	    size_t i = index(j, order[k].second, bucket);
+	    if (used[i]) {
+	      type.push_back(j);
+	      item.push_back(order[k].first);
+	      age.push_back(partition[bucket]);
+	      costs.push_back(totals[i].value());
+	    }
+	  }
+      return List::create(_("type") = Rcpp::wrap(type), _("item") = Rcpp::wrap(item),
+			  _("age") = Rcpp::wrap(age), _("costs") = Rcpp::wrap(costs));
+    }
+  };
+
+  /** Clear a vector and give its memory back */
+  template<class T> void freeVector(vector<T>& v) { vector<T>().swap(v); }
+
+  /**
+     @brief EventReport keyed by a small integer state code, with dense
+     arrays for the person-time, utilities, prevalence and events.
+
+     The arrays for a state, and for a (state, event kind), are
+     allocated on first use. The age partition is searched by index
+     arithmetic when it has equal steps (as for ages 0, 1, ..., 100).
+     Time intervals are split over the partition as for EventReport,
+     and wrap() returns the same pt, ut, events and prev columns, with
+     the keys given by a codes object (e.g. FullState::Codes). As for
+     CostAccumulator, the person-time and utilities for a block of men
+     are added to exact totals by flush().
+  */
+  class StateEventReport {
+  public:
+    double discountRate;
+    vector<double> partition; // ascending
+    double step; // spacing of the partition, or 0.0 if not equally spaced
+    int nstates, nkinds;
+    vector<int> stateSlot, eventSlot; // offsets into the arrays, or -1
+    vector<double> pt, ut; // pt[stateSlot[state] + bucket], current block
+    vector<ExactSum> ptTotal, utTotal;
+    vector<int> prev;
+    vector<char> visited;
+    vector<int> events; // events[eventSlot[state*nkinds + kind] + bucket]
+    double tableRate, alpha; // discount rate for the table, and log(1+rate)
+    vector<double> discount; // exp(-alpha*partition[i])/alpha
+    StateEventReport(double discountRate = 0.0) : discountRate(discountRate), step(0.0),
+						    nstates(0), nkinds(0), tableRate(0.0), alpha(0.0) {}
+    void setPartition(const vector<double>& v) {
+      partition = v;
+      sort(partition.begin(), partition.end());
+      // equal steps, allowing for a final large bound (e.g. 1.0e+6)
+      size_t n = partition.size();
+      step = n > 2 ? partition[1] - partition[0] : 0.0;
+      for (size_t i = 2; i + 1 < n; ++i)
+	if (fabs(partition[i] - partition[i-1] - step) > 1.0e-10 * step) step = 0.0;
+      setDiscount();
+      clear();
+    }
+    /**
+       Tabulate the discount integral at the partition boundaries, so
+       that an interval needs only the exponentials at its ends
+    */
+    void setDiscount() {
+      tableRate = discountRate;
+      alpha = log(1.0 + discountRate);
+      discount.assign(partition.size(), 0.0);
+      if (discountRate != 0.0)
+	for (size_t i = 0; i < partition.size(); ++i)
+	  discount[i] = exp(-alpha * partition[i]) / alpha;
+    }
+    void setStates(int nstates, int nkinds) {
+      this->nstates = nstates;
+      this->nkinds = nkinds;
+      clear();
+    }
+    void clear() {
+      stateSlot.assign(nstates, -1);
+      eventSlot.assign(size_t(nstates) * nkinds, -1);
+      pt.clear(); ut.clear(); ptTotal.clear(); utTotal.clear();
+      prev.clear(); visited.clear(); events.clear();
+    }
+    /** Add the person-time and utilities for the current block to the totals */
+    void flush() {
+      for (size_t i = 0; i < pt.size(); ++i) {
+	ptTotal[i] += pt[i];
+	utTotal[i] += ut[i];
+	pt[i] = ut[i] = 0.0;
+      }
+    }
+    /** Clear the results and give their memory back (e.g. after wrap()) */
+    void release() {
+      freeVector(stateSlot); freeVector(eventSlot);
+      freeVector(pt); freeVector(ut); freeVector(ptTotal); freeVector(utTotal);
+      freeVector(prev); freeVector(visited); freeVector(events);
+    }
+    /** Index of the largest partition value at or below time (or 0) */
+    int bucket(double time) const {
+      int n = partition.size(), i;
+      if (step > 0.0) {
+	i = int(floor((time - partition[0]) / step));
+	if (i < 0) i = 0;
+	if (i > n - 1) i = n - 1;
+	while (i > 0 && partition[i] > time) --i;
+	while (i + 1 < n && partition[i+1] <= time) ++i;
+      } else {
+	i = int(upper_bound(partition.begin(), partition.end(), time) - partition.begin()) - 1;
+	if (i < 0) i = 0;
+      }
+      return i;
+    }
+    double discountedInterval(double a, double b, double utility) const {
+      if (discountRate == 0.0) return utility * (b - a);
+      if (a == b) return 0.0;
+      double alpha = (tableRate == discountRate) ? this->alpha : log(1.0 + discountRate);
+      return utility / alpha * (exp(-alpha * a) - exp(-alpha * b));
+    }
+    void add(int state, short kind, double lhs, double rhs, double utility = 1.0) {
+      int np = partition.size();
+      int lo = bucket(lhs), hi = bucket(rhs);
+      ++events[eventOffset(state, kind) + hi];
+      int offset = stateOffset(state);
+      if (discountRate == 0.0) {
+	for (int i = lo; i <= hi; ++i) {
+	  double a = max(lhs, partition[i]);
+	  double b = (i + 1 < np) ? min(partition[i+1], rhs) : rhs;
+	  if (lhs <= partition[i] && partition[i] < rhs) // cadlag
+	    ++prev[offset + i];
+	  pt[offset + i] += b - a;
+	  ut[offset + i] += utility * (b - a);
+	  visited[offset + i] = 1;
+	}
+	return;
+      }
+      if (tableRate != discountRate) setDiscount();
+      // the discount integral at the ends, and from the table in between
+      double dlhs = exp(-alpha * lhs) / alpha, drhs = exp(-alpha * rhs) / alpha;
+      for (int i = lo; i <= hi; ++i) {
+	bool first = partition[i] <= lhs, last = i + 1 >= np || rhs <= partition[i+1];
+	double a = first ? lhs : partition[i];
+	double b = last ? rhs : partition[i+1];
+	if (lhs <= partition[i] && partition[i] < rhs) // cadlag
+	  ++prev[offset + i];
+	pt[offset + i] += b - a;
+	ut[offset + i] += (a == b) ? 0.0 :
+	  utility * ((first ? dlhs : discount[i]) - (last ? drhs : discount[i+1]));
+	visited[offset + i] = 1;
+      }
+    }
+    template<class Archive>
+    void checkpoint(Archive& ar) {
+      ar.io(stateSlot); ar.io(eventSlot);
+      ar.io(pt); ar.io(ut); ar.io(ptTotal); ar.io(utTotal);
+      ar.io(prev); ar.io(visited); ar.io(events);
+    }
+    /** Add the totals from another report with the same partition and states */
+    void append(const StateEventReport& other) {
+      int np = partition.size();
+      for (int state = 0; state < nstates; ++state) {
+	if (other.stateSlot[state] >= 0) {
+	  int to = stateOffset(state), from = other.stateSlot[state];
+	  for (int i = 0; i < np; ++i) {
+	    ptTotal[to + i] += other.ptTotal[from + i];
+	    utTotal[to + i] += other.utTotal[from + i];
+	    prev[to + i] += other.prev[from + i];
+	    visited[to + i] = visited[to + i] || other.visited[from + i];
+	  }
+	}
+	for (int kind = 0; kind < nkinds; ++kind) {
+	  size_t k = size_t(state) * nkinds + kind;
+	  if (other.eventSlot[k] >= 0) {
+	    int to = eventOffset(state, kind), from = other.eventSlot[k];
+	    for (int i = 0; i < np; ++i)
+	      events[to + i] += other.events[from + i];
+	  }
+	}
+      }
+    }
+    template<class Codes>
+    SEXP wrap(const Codes& codes) const {
+      vector<int> ptStates, prevStates, eventStates;
+      vector<double> ptAges, prevAges, eventAges, ptValues, utValues;
+      vector<int> prevValues, eventKinds, eventValues;
+      int np = partition.size();
+      for (int state = 0; state < nstates; ++state) {
+	int offset = stateSlot[state];
+	if (offset >= 0)
+	  for (int i = 0; i < np; ++i) {
+	    if (visited[offset + i]) { // as for the maps, including zero person-time
+	      ptStates.push_back(state);
+	      ptAges.push_back(partition[i]);
+	      ptValues.push_back(ptTotal[offset + i].value());
+	      utValues.push_back(utTotal[offset + i].value());
+	    }
+	    if (prev[offset + i] > 0) {
+	      prevStates.push_back(state);
+	      prevAges.push_back(partition[i]);
+	      prevValues.push_back(prev[offset + i]);
+	    }
+	  }
+	for (int kind = 0; kind < nkinds; ++kind) {
+	  int offset = eventSlot[size_t(state) * nkinds + kind];
+	  if (offset >= 0)
+	    for (int i = 0; i < np; ++i)
+	      if (events[offset + i] > 0) {
+		eventStates.push_back(state);
+		eventKinds.push_back(kind);
+		eventAges.push_back(partition[i]);
+		eventValues.push_back(events[offset + i]);
+	      }
+	}
+      }
+      if (eventStates.empty()) return List();
+      return List::create(_("pt") = List::create(_("Key") = codes.columns(ptStates),
+						 _("age") = Rcpp::wrap(ptAges),
+						 _("pt") = Rcpp::wrap(ptValues)),
+			  _("ut") = List::create(_("Key") = codes.columns(ptStates),
+						 _("age") = Rcpp::wrap(ptAges),
+						 _("ut") = Rcpp::wrap(utValues)),
+			  _("events") = List::create(_("Key") = codes.columns(eventStates),
+						     _("event") = Rcpp::wrap(eventKinds),
+						     _("age") = Rcpp::wrap(eventAges),
+						     _("number") = Rcpp::wrap(eventValues)),
+			  _("prev") = List::create(_("Key") = codes.columns(prevStates),
+						   _("age") = Rcpp::wrap(prevAges),
+						   _("number") = Rcpp::wrap(prevValues)));
+    }
+  private:
+    /** Offsets of the arrays for a state, allocated on first use */
+    int stateOffset(int state) {
+      int& offset = stateSlot[state];
+      if (offset < 0) {
+	offset = pt.size();
+	pt.resize(offset + partition.size(), 0.0);
+	ut.resize(pt.size(), 0.0);
+	ptTotal.resize(pt.size());
+	utTotal.resize(pt.size());
+	prev.resize(pt.size(), 0);
+	visited.resize(pt.size(), 0);
+      }
+      return offset;
+    }
+    int eventOffset(int state, short kind) {
+      int& offset = eventSlot[size_t(state) * nkinds + kind];
+      if (offset < 0) {
+	offset = events.size();
+	events.resize(offset + partition.size(), 0);
+      }
+      return offset;
+    }
+  };
+
+  /** Life-history rows as columns: id, ext_state, ext_grade, dx and event, then begin, end, year, psa and utility */
+  struct LifeHistoryBatch {
+    vector<boost::int32_t> ints[5];
+    vector<double> doubles[5];
+    size_t size() const { return ints[0].size(); }
+    void clear() {
+      for (int j = 0; j < 5; ++j) {
+	ints[j].clear();
+	doubles[j].clear();
+      }
+    }
+  };
+
+  /**
+     @brief Binary life-history file shared by the workers.
+
+     The file starts with the 8 bytes "FHCRCLH1". Each batch is an int32
+     row count, then the id, ext_state, ext_grade, dx and event columns
+     as int32 and the begin, end, year, psa and utility columns as
+     doubles, all in native byte order. There is one batch for each
+     block of men with any rows. The batches are written as the blocks
+     finish, so readLifeHistories() in R orders them by their first id.
+     The destructor closes a file that is still open after an error.
+  */
+  class LifeHistoryFile {
+  public:
+    LifeHistoryFile() : file(NULL), failed(false) {}
+    ~LifeHistoryFile() { if (file) fclose(file); }
+    /** Create the file and write the header; false on failure */
+    bool open(const string& name) {
+      file = fopen(name.c_str(), "wb");
+      return file != NULL && fwrite("FHCRCLH1", 1, 8, file) == 8;
+    }
+    /** Close the file; false if it or any batch could not be written */
+    bool close() {
+      bool ok = fclose(file) == 0 && !failed;
+      file = NULL;
+      return ok;
+    }
+    bool isOpen() const { return file != NULL; }
+    /** Append the rows for a block of men */
+    void write(const LifeHistoryBatch& batch) {
+      boost::int32_t n = batch.size();
+      if (n == 0) return;
+#pragma omp critical(fhcrc_life_histories)
+      {
+	bool ok = fwrite(&n, sizeof(n), 1, file) == 1;
+	for (int j = 0; j < 5; ++j)
+	  ok = ok && fwrite(&batch.ints[j][0], sizeof(boost::int32_t), n, file) == size_t(n);
+	for (int j = 0; j < 5; ++j)
+	  ok = ok && fwrite(&batch.doubles[j][0], sizeof(double), n, file) == size_t(n);
+	if (!ok) failed = true;
+      }
+    }
+  private:
+    FILE* file;
+    bool failed;
+    LifeHistoryFile(const LifeHistoryFile&); // not copyable
+  };
+
+  /**
+     @brief Collects a worker's life-history rows for the current block,
+     for a LifeHistoryFile.
+  */
+  class LifeHistorySink {
+  public:
+    LifeHistoryFile* file; // shared; NULL if not streaming
+    LifeHistorySink() : file(NULL) {}
+    void add(const LifeHistory::Type& row) {
+      using boost::get;
+      batch.ints[0].push_back(get<LifeHistory::id>(row));
+      batch.ints[1].push_back(get<LifeHistory::ext_state>(row));
+      batch.ints[2].push_back(get<LifeHistory::ext_grade>(row));
+      batch.ints[3].push_back(get<LifeHistory::dx>(row));
+      batch.ints[4].push_back(get<LifeHistory::event>(row));
+      batch.doubles[0].push_back(get<LifeHistory::begin>(row));
+      batch.doubles[1].push_back(get<LifeHistory::end>(row));
+      batch.doubles[2].push_back(get<LifeHistory::year>(row));
+      batch.doubles[3].push_back(get<LifeHistory::psa>(row));
+      batch.doubles[4].push_back(get<LifeHistory::utility>(row));
+    }
+    /** Pass the rows for the block to the file */
+    void endBlock() {
+      file->write(batch);
+      batch.clear();
+    }
+  private:
+    LifeHistoryBatch batch;
+  };
+
+  /**
+     @brief Records with a fixed set of double columns, such as those in
+     PsaRecord.
+
+     The rows are stored one after another in a single vector, so that
+     add() is one append; the fields are then set by index. wrap()
+     returns the same list of columns as SimpleReport<double>.
+  */
+  class RecordReport {
+  public:
+    const char* const* names;
+    int ncols;
+    vector<double> data; // data[row*ncols + field]
+    RecordReport(const char* const* names, int ncols) : names(names), ncols(ncols) {}
+    size_t size() const { return data.size() / ncols; }
+    void reserve(size_t rows) { data.reserve(rows * ncols); }
+    void clear() { data.clear(); }
+    void release() { freeVector(data); }
+    /** Append a row of NA and return a pointer to its fields */
+    double* add() {
+      data.resize(data.size() + ncols, NA_REAL);
+      return last();
+    }
+    /** The fields of the last row */
+    double* last() { return &data[data.size() - ncols]; }
+    template<class Archive>
+    void checkpoint(Archive& ar) { ar.io(data); }
+    void append(const RecordReport& other) {
+      data.insert(data.end(), other.data.begin(), other.data.end());
+    }
+    /**
+       Order the rows by the id in their first field, keeping the order
+       of the rows for each man. The workers' rows are merged by worker
+       rather than by man.
+    */
+    void sortById() {
+      size_t n = size();
+      vector<pair<double,size_t> > keys(n);
+      bool sorted = true;
+      for (size_t i = 0; i < n; ++i) {
+	keys[i] = make_pair(data[i*ncols], i);
+	if (i > 0 && keys[i].first < keys[i-1].first) sorted = false;
+      }
+      if (sorted) return;
+      sort(keys.begin(), keys.end()); // the row breaks ties
+      vector<double> rows(data.size());
+      for (size_t i = 0; i < n; ++i)
+	copy(&data[keys[i].second*ncols], &data[keys[i].second*ncols] + ncols, &rows[i*ncols]);
+      data.swap(rows);
+    }
+    SEXP wrap() const {
+      List result;
+      size_t n = size();
+      if (n == 0) return result;
+      // alphabetical column order, as for the string keys of SimpleReport
+      vector<pair<string,int> > order;
+      for (int j = 0; j < ncols; ++j)
+	order.push_back(make_pair(string(names[j]), j));
+      sort(order.begin(), order.end());
+      for (size_t k = 0; k < order.size(); ++k) {
+	NumericVector column(n);
+	const double* x = &data[order[k].second];
+	for (size_t i = 0; i < n; ++i, x += ncols)
+	  column[i] = *x;
+	result.push_back(column, order[k].first);
+      }
+      return result;
+    }
+  };
+
+  /** Compare life histories by id, for a stable sort */
+  struct LifeHistoryIdLess {
+    bool operator()(const LifeHistory::Type& a, const LifeHistory::Type& b) const {
+      return boost::get<LifeHistory::id>(a) < boost::get<LifeHistory::id>(b);
+    }
+  };
+  /** Order life histories by id, keeping the order of the rows for each man */
+  inline void sortById(vector<LifeHistory::Type>& rows) {
+    vector<LifeHistory::Type>::iterator it = rows.begin();
+    while (it != rows.end() && it + 1 != rows.end() && !LifeHistoryIdLess()(*(it+1), *it)) ++it;
+    if (it != rows.end() && it + 1 != rows.end())
+      stable_sort(rows.begin(), rows.end(), LifeHistoryIdLess());
+  }
+
+  /** Exact totals for a Means, added by block (see ExactSum) */
+  class MeansTotal {
+  public:
+    long n;
+    ExactSum sum, sumsq;
+    MeansTotal() : n(0L) {}
+    /** Add the means for a block, and reset them */
+    void flush(Means& block) {
+      n += block._n;
+      sum += block._sum;
+      sumsq += block._sumsq;
+      block = Means();
+    }
+    void append(const MeansTotal& other) {
+      n += other.n;
+      sum += other.sum;
+      sumsq += other.sumsq;
+    }
+    SEXP wrap() const {
+      Means means;
+      means._n = n;
+      means._sum = sum.value();
+      means._sumsq = sumsq.value();
+      return means.wrap();
+    }
+  };
+
   class SimOutput {
   public:
-    EventReport<FullState::Type,short,double> report;
-    EventReport<int,short,double> shortReport;
-    CostReport<CostKey> costs;
+    StateEventReport report; // keyed by FullState::Codes
+    StateEventReport shortReport;
+    CostAccumulator costs;
     vector<LifeHistory::Type> lifeHistories;
-    SimpleReport<double> outParameters;
-    SimpleReport<double> psarecord, bxrecord, falsePositives;
-    SimpleReport<double> diagnoses;
-    Means tmc_minus_t0;
+    LifeHistorySink lifeHistorySink;
+    RecordReport outParameters;
+    RecordReport psarecord, bxrecord, falsePositives;
+    RecordReport diagnoses;
+    Means tmc_minus_t0; // current block
+    MeansTotal tmc_minus_t0Total;
+    double outcome[Outcome::N]; // for the current man
+    Means outcomes[Outcome::N]; // over the men in the current block
+    MeansTotal outcomesTotal[Outcome::N];
+    Profile profile;
+    bool profiling;
+    short unknownKind; // an event kind not handled by FhcrcPerson, or -1
+    SimOutput() :
+      outParameters(ParameterRecord::names, ParameterRecord::N),
+      psarecord(PsaRecord::names, PsaRecord::N),
+      bxrecord(BxRecord::names, BxRecord::N),
+      falsePositives(FalsePositiveRecord::names, FalsePositiveRecord::N),
+      diagnoses(DiagnosisRecord::names, DiagnosisRecord::N),
+      profiling(false), unknownKind(-1) { fill(outcome, outcome + Outcome::N, 0.0); }
+    /** Add the current man's outcomes to the means */
+    void endPerson() {
+      for (int j = 0; j < Outcome::N; ++j) {
+	outcomes[j] += outcome[j];
+	outcome[j] = 0.0;
+      }
+    }
+    void addLifeHistory(const LifeHistory::Type& row) {
+      if (lifeHistorySink.file) lifeHistorySink.add(row);
+      else lifeHistories.push_back(row);
+    }
+    /** Add the sums for the current block to the exact totals */
+    void flush() {
+      report.flush();
+      shortReport.flush();
+      costs.flush();
+      tmc_minus_t0Total.flush(tmc_minus_t0);
+      for (int j = 0; j < Outcome::N; ++j)
+	outcomesTotal[j].flush(outcomes[j]);
+    }
+    /** Merge the results from another worker into this one */
+    void append(SimOutput& other) {
+      report.append(other.report);
+      shortReport.append(other.shortReport);
+      costs.append(other.costs);
+      lifeHistories.insert(lifeHistories.end(), other.lifeHistories.begin(), other.lifeHistories.end());
+      outParameters.append(other.outParameters);
+      psarecord.append(other.psarecord);
+      bxrecord.append(other.bxrecord);
+      falsePositives.append(other.falsePositives);
+      diagnoses.append(other.diagnoses);
+      tmc_minus_t0Total.append(other.tmc_minus_t0Total);
+      for (int j = 0; j < Outcome::N; ++j)
+	outcomesTotal[j].append(other.outcomesTotal[j]);
+      profile.append(other.profile);
+    }
+    /** Clear the results, keeping the partitions and states */
+    void clearResults() {
+      report.clear();
+      shortReport.clear();
+      costs.clear();
+      lifeHistories.clear();
+      outParameters.clear();
+      psarecord.clear();
+      bxrecord.clear();
+      falsePositives.clear();
+      diagnoses.clear();
+      tmc_minus_t0 = Means();
+      tmc_minus_t0Total = MeansTotal();
+      for (int j = 0; j < Outcome::N; ++j) {
+	outcome[j] = 0.0;
+	outcomes[j] = Means();
+	outcomesTotal[j] = MeansTotal();
+      }
+      profile.clear();
+    }
+    /** Read or write the results (see CheckpointWriter) */
+    template<class Archive>
+    void checkpoint(Archive& ar) {
+      report.checkpoint(ar);
+      shortReport.checkpoint(ar);
+      costs.checkpoint(ar);
+      boost::int64_t nrows = lifeHistories.size();
+      ar.io(nrows);
+      lifeHistories.resize(nrows);
+      for (size_t i = 0; i < lifeHistories.size(); ++i) {
+	using boost::get;
+	LifeHistory::Type& row = lifeHistories[i];
+	ar.io(get<LifeHistory::id>(row)); ar.io(get<LifeHistory::ext_state>(row));
+	ar.io(get<LifeHistory::ext_grade>(row)); ar.io(get<LifeHistory::dx>(row));
+	ar.io(get<LifeHistory::event>(row)); ar.io(get<LifeHistory::begin>(row));
+	ar.io(get<LifeHistory::end>(row)); ar.io(get<LifeHistory::year>(row));
+	ar.io(get<LifeHistory::psa>(row)); ar.io(get<LifeHistory::utility>(row));
+      }
+      outParameters.checkpoint(ar);
+      psarecord.checkpoint(ar);
+      bxrecord.checkpoint(ar);
+      falsePositives.checkpoint(ar);
+      diagnoses.checkpoint(ar);
+      ar.io(tmc_minus_t0Total.n); ar.io(tmc_minus_t0Total.sum); ar.io(tmc_minus_t0Total.sumsq);
+      for (int j = 0; j < Outcome::N; ++j) {
+	ar.io(outcomesTotal[j].n); ar.io(outcomesTotal[j].sum); ar.io(outcomesTotal[j].sumsq);
+      }
+      profile.checkpoint(ar);
+    }
+    /** Reserve the records for scale times the current number of rows */
+    void reserve(double scale) {
+      outParameters.reserve(size_t(scale * outParameters.size()));
+      psarecord.reserve(size_t(scale * psarecord.size()));
+      bxrecord.reserve(size_t(scale * bxrecord.size()));
+      falsePositives.reserve(size_t(scale * falsePositives.size()));
+      diagnoses.reserve(size_t(scale * diagnoses.size()));
+    }
+    List wrap(const FullState::Codes& fullStates);
   };
   // SimOutput * out; // in callFhcrc
   // &out in the Person object
@@ -107,45 +997,317 @@ namespace fhcrc_example {
 
 
   typedef std::pair<double,double> Double;
-  typedef Table<double,double,int,double> TablePrtx; // Age, DxY, G
-  typedef Table<double,int,int,double> TableLocoHR; // Age, G, PSA10+
   typedef Table<double,double> TableDD; // Age
   typedef Table<double,double> TableMetastaticHR; // Age
-  typedef Table<int,double,double,int,double> TablePradt;
-  typedef Table<double,double,double> TableBiopsyCompliance;
-  typedef Table<double,double,double> TableDDD; // as per TableBiopsyCompliance
-  typedef map<int,NumericInterpolate> H_dist_t;
-  typedef map<pair<double,int>,NumericInterpolate> H_local_t;
+
+  /**
+     @brief Lookup table on a grid of one to four axes. All of the
+     requested value columns of a data frame are stored together for
+     each grid cell.
+
+     As with Table, each coordinate is matched to the largest grid value
+     at or below it (or the smallest grid value). The axes are sorted
+     vectors, and one lookup returns a pointer to all of the values for
+     the cell.
+  */
+  class GridTable {
+  public:
+    vector<vector<double> > axes; // sorted grid values for each axis
+    vector<size_t> strides;
+    int nvalues;
+    vector<double> values; // values[cell*nvalues + k]
+    GridTable() : nvalues(0) {}
+    /** Axis and value columns are given as comma-separated column names */
+    GridTable(const DataFrame& df, const string& axisNames, const string& valueNames) {
+      vector<string> axisCols = split(axisNames), valueCols = split(valueNames);
+      nvalues = valueCols.size();
+      vector<NumericVector> x, y;
+      for (size_t j=0; j<axisCols.size(); ++j)
+	x.push_back(as<NumericVector>(df[axisCols[j]]));
+      for (size_t k=0; k<valueCols.size(); ++k)
+	y.push_back(as<NumericVector>(df[valueCols[k]]));
+      int n = x[0].size();
+      axes.resize(x.size());
+      strides.resize(x.size());
+      for (size_t j=0; j<x.size(); ++j) {
+	axes[j].assign(x[j].begin(), x[j].end());
+	sort(axes[j].begin(), axes[j].end());
+	axes[j].erase(unique(axes[j].begin(), axes[j].end()), axes[j].end());
+      }
+      size_t ncells = 1;
+      for (int j=int(axes.size())-1; j>=0; --j) {
+	strides[j] = ncells;
+	ncells *= axes[j].size();
+      }
+      values.assign(ncells*nvalues, NA_REAL);
+      for (int i=0; i<n; ++i) {
+	size_t cell = 0;
+	for (size_t j=0; j<x.size(); ++j)
+	  cell += strides[j]*index(j, x[j][i]);
+	for (int k=0; k<nvalues; ++k)
+	  values[cell*nvalues + k] = y[k][i];
+      }
+    }
+    size_t index(size_t axis, double x) const {
+      const vector<double>& v = axes[axis];
+      int i = int(upper_bound(v.begin(), v.end(), x) - v.begin()) - 1;
+      return i < 0 ? 0 : size_t(i);
+    }
+    const double* cell(size_t offset) const { return &values[offset*nvalues]; }
+    const double* operator()(double x0) const {
+      return cell(index(0,x0));
+    }
+    const double* operator()(double x0, double x1) const {
+      return cell(strides[0]*index(0,x0) + index(1,x1));
+    }
+    const double* operator()(double x0, double x1, double x2) const {
+      return cell(strides[0]*index(0,x0) + strides[1]*index(1,x1) + index(2,x2));
+    }
+    const double* operator()(double x0, double x1, double x2, double x3) const {
+      return cell(strides[0]*index(0,x0) + strides[1]*index(1,x1) + strides[2]*index(2,x2) + index(3,x3));
+    }
+  private:
+    static vector<string> split(const string& names) {
+      vector<string> out;
+      size_t start = 0, end;
+      while ((end = names.find(',', start)) != string::npos) {
+	out.push_back(names.substr(start, end-start));
+	start = end+1;
+      }
+      out.push_back(names.substr(start));
+      return out;
+    }
+  };
+  enum prtx_t {PrtxCM, PrtxRP}; // value columns of SimInput::prtx
+  enum rescreen_t {RescreenShape, RescreenScale, RescreenCure}; // value columns of SimInput::rescreen
+
+  /**
+     @brief Cumulative hazard curves by (age band, grade), stored
+     contiguously and indexed at load time.
+
+     The age band for an age is the band with the largest lower bound at
+     or below that age (or the first band). Curves without an age use a
+     single band.
+  */
+  class SurvivalTable {
+  public:
+    vector<double> ages; // lower bounds of the age bands, ascending
+    int ngrades;
+    vector<NumericInterpolate> H; // H[band*ngrades + grade]
+    SurvivalTable() : ngrades(0) {}
+    void clear() { ages.clear(); H.clear(); ngrades = 0; }
+    /** Set up the table from columns of (age band, grade, time, survival) */
+    template<class Ages, class Grades, class Times, class Survivals>
+    void build(const Ages& age, const Grades& grade, const Times& time, const Survivals& survival, int n) {
+      clear();
+      for (int i=0; i<n; ++i) {
+	ages.push_back(age[i]);
+	ngrades = max(ngrades, int(grade[i])+1);
+      }
+      sort(ages.begin(), ages.end());
+      ages.erase(unique(ages.begin(), ages.end()), ages.end());
+      H.assign(ages.size()*ngrades, NumericInterpolate());
+      vector<char> used(H.size(), 0);
+      for (int i=0; i<n; ++i) {
+	size_t j = index(band(age[i]), grade[i]);
+	H[j].push_back(Double(time[i],-log(survival[i])));
+	used[j] = 1;
+      }
+      for (size_t j=0; j<H.size(); ++j)
+	if (used[j]) H[j].prepare();
+    }
+    int band(double age) const {
+      int i = int(upper_bound(ages.begin(), ages.end(), age) - ages.begin()) - 1;
+      return i < 0 ? 0 : i;
+    }
+    size_t index(int band, int grade) const { return band*ngrades + grade; }
+    NumericInterpolate& operator()(double age, int grade) { return H[index(band(age), grade)]; }
+    /** Time for a cumulative hazard y */
+    double invert(double age, int grade, double y) { return (*this)(age, grade).invert(y); }
+  };
+
+  /**
+     @brief Named vector copied out of an R vector.
+
+     Lookups by name only use C++ storage, so that the parameters can be
+     read from the worker threads without calling into R.
+  */
+  template<class T>
+  class NamedVector {
+  public:
+    vector<string> names;
+    vector<T> values;
+    NamedVector() {}
+    template<class RVector>
+    NamedVector(RVector x) : values(x.begin(), x.end()) {
+      if (!Rf_isNull(x.names()))
+	names = as<vector<string> >(x.names());
+    }
+    T operator[](const string& name) const {
+      for (size_t i = 0; i < names.size(); ++i)
+	if (names[i] == name) return values[i];
+      throw std::out_of_range("NamedVector: no element named " + name);
+    }
+    T operator()(const string& name) const { return operator[](name); }
+    T get(const string& name, T otherwise) const {
+      for (size_t i = 0; i < names.size(); ++i)
+	if (names[i] == name) return values[i];
+      return otherwise;
+    }
+    T operator[](int i) const { return values[i]; }
+  };
+  typedef NamedVector<double> NamedNumeric;
+  typedef NamedVector<bool> NamedLogical;
+
+  /**
+     @brief Parameters resolved once from the named vectors in SimInput,
+     so that the simulation does not look up parameters by name.
+  */
+  struct Parameters {
+    double PSA_FP_threshold_GG6, PSA_FP_threshold_GG7plus,
+      PSA_FP_threshold_nCa, RP_mortHR, RR_T3plus, alpha7, alpha8, beta7, beta8,
+      biopsySensitivityTimeProportionT1T2, c_baseline_specific,
+      c_benefit_value0, c_benefit_value1, c_low_grade_slope,
+      c_txlt_interaction, endUptakeMixture, fullUptakePortion, g0, g3p, gc, gm,
+      grade_clinical_rate_high, introduction_year, mubeta0, mubeta1,
+      panelReflexThreshold, psaThreshold, psaThresholdBiopsyFollowUp, rFPF,
+      rand_biopsy_sensitivityG6, rescreeningParticipation, scaleA, scaleT,
+      screeningIntroduced, screeningParticipation, screening_interval, sebeta0,
+      sebeta1, shapeA, shapeT, startFullUptake, startUptakeMixture,
+      start_screening, stop_screening, studyParticipation, susceptible,
+      sxbenefit, tau2, thetac, yearlyUptakeIncrease;
+    bool includeBxrecords, includeDiagnoses, includePSArecords,
+      revised_natural_history, stockholmTreatment, utility_truncate,
+      utility_background_analytic, lazy_psa, analytic_healthy, calendar_queue,
+      full_report, formal_costs, formal_compliance;
+    survival_t c_benefit_type;
+    biomarker_model_t biomarker_model;
+    utility_scale_t utility_scale;
+    void resolve(const NamedNumeric& parameter, const NamedLogical& bparameter) {
+      PSA_FP_threshold_GG6 = parameter["PSA_FP_threshold_GG6"];
+      PSA_FP_threshold_GG7plus = parameter["PSA_FP_threshold_GG7plus"];
+      PSA_FP_threshold_nCa = parameter["PSA_FP_threshold_nCa"];
+      RP_mortHR = parameter["RP_mortHR"];
+      RR_T3plus = parameter["RR_T3plus"];
+      alpha7 = parameter["alpha7"];
+      alpha8 = parameter["alpha8"];
+      beta7 = parameter["beta7"];
+      beta8 = parameter["beta8"];
+      biopsySensitivityTimeProportionT1T2 = parameter["biopsySensitivityTimeProportionT1T2"];
+      c_baseline_specific = parameter["c_baseline_specific"];
+      c_benefit_value0 = parameter["c_benefit_value0"];
+      c_benefit_value1 = parameter["c_benefit_value1"];
+      c_low_grade_slope = parameter["c_low_grade_slope"];
+      c_txlt_interaction = parameter["c_txlt_interaction"];
+      endUptakeMixture = parameter["endUptakeMixture"];
+      fullUptakePortion = parameter["fullUptakePortion"];
+      g0 = parameter["g0"];
+      g3p = parameter["g3p"];
+      gc = parameter["gc"];
+      gm = parameter["gm"];
+      grade_clinical_rate_high = parameter["grade.clinical.rate.high"];
+      introduction_year = parameter["introduction_year"];
+      mubeta0 = parameter["mubeta0"];
+      mubeta1 = parameter["mubeta1"];
+      panelReflexThreshold = parameter["panelReflexThreshold"];
+      psaThreshold = parameter["psaThreshold"];
+      psaThresholdBiopsyFollowUp = parameter["psaThresholdBiopsyFollowUp"];
+      rFPF = parameter["rFPF"];
+      rand_biopsy_sensitivityG6 = parameter["rand_biopsy_sensitivityG6"];
+      rescreeningParticipation = parameter["rescreeningParticipation"];
+      scaleA = parameter["scaleA"];
+      scaleT = parameter["scaleT"];
+      screeningIntroduced = parameter["screeningIntroduced"];
+      screeningParticipation = parameter["screeningParticipation"];
+      screening_interval = parameter["screening_interval"];
+      sebeta0 = parameter["sebeta0"];
+      sebeta1 = parameter["sebeta1"];
+      shapeA = parameter["shapeA"];
+      shapeT = parameter["shapeT"];
+      startFullUptake = parameter["startFullUptake"];
+      startUptakeMixture = parameter["startUptakeMixture"];
+      start_screening = parameter["start_screening"];
+      stop_screening = parameter["stop_screening"];
+      studyParticipation = parameter["studyParticipation"];
+      susceptible = parameter["susceptible"];
+      sxbenefit = parameter["sxbenefit"];
+      tau2 = parameter["tau2"];
+      thetac = parameter["thetac"];
+      yearlyUptakeIncrease = parameter["yearlyUptakeIncrease"];
+      includeBxrecords = bparameter["includeBxrecords"];
+      includeDiagnoses = bparameter["includeDiagnoses"];
+      includePSArecords = bparameter["includePSArecords"];
+      revised_natural_history = bparameter["revised_natural_history"];
+      stockholmTreatment = bparameter["stockholmTreatment"];
+      utility_truncate = bparameter["utility_truncate"];
+      utility_background_analytic = bparameter["utility_background_analytic"];
+      lazy_psa = bparameter["lazy_psa"];
+      analytic_healthy = bparameter["analytic_healthy"];
+      calendar_queue = bparameter["calendar_queue"];
+      full_report = parameter["full_report"] == 1.0;
+      formal_costs = parameter["formal_costs"] == 1.0;
+      formal_compliance = parameter["formal_compliance"] == 1.0;
+      c_benefit_type = survival_t(int(parameter["c_benefit_type"]));
+      biomarker_model = biomarker_model_t(int(parameter["biomarker_model"]));
+      utility_scale = utility_scale_t(int(parameter["utility_scale"]));
+    }
+  };
+
+  /**
+     @brief The properties of a screening scenario that the event handlers
+     use, resolved once per scenario rather than at every event.
+  */
+  struct ScreeningPolicy {
+    int screen; // screen_t
+    bool mixed_programs; // organised and opportunistic screening
+    bool formal_costs, formal_compliance; // for the organised screens
+    ScreeningPolicy() : screen(noScreening), mixed_programs(false),
+			formal_costs(false), formal_compliance(false) {}
+    ScreeningPolicy(int screen, const Parameters& par) : screen(screen) {
+      mixed_programs = (screen == mixed_screening) ||
+	(screen == introduced_screening) ||
+	(screen == introduced_screening_preference) ||
+	(screen == stopped_screening);
+      formal_costs = par.formal_costs;
+      formal_compliance = par.formal_compliance;
+    }
+  };
+
   class SimInput {
   public:
-    TableLocoHR hr_locoregional;
+    FullState::Codes fullStates; // for SimOutput::report
+    GridTable hr_locoregional; // (age, ext_grade, psa10) -> hr
     TableMetastaticHR hr_metastatic;
     TableDD tableBiopsySensitivity, tableSecularTrendTreatment2008OR,
       tableNegBiopsyToPSAmeanlog, tableNegBiopsyToPSAsdlog, tableNegBiopsyToBiopsymeanlog,
       tableNegBiopsyToBiopsysdlog, tableCMtoRPpnever, tableCMtoRPmeanlog, tableCMtoRPsdlog,
       tableCMtoRTpnever, tableCMtoRTmeanlog, tableCMtoRTsdlog;
-    TablePrtx prtxCM, prtxRP;
-    TablePradt pradt;
-    TableBiopsyCompliance tableOpportunisticBiopsyCompliance, tableFormalBiopsyCompliance;
-    TableDDD rescreen_shape, rescreen_scale, rescreen_cure;
+    GridTable prtx; // (Age, DxY, G) -> (CM, RP)
+    GridTable pradt; // (Tx, Age, DxY, Grade) -> ADT
+    GridTable tableOpportunisticBiopsyCompliance, tableFormalBiopsyCompliance; // (psa, age) -> compliance
+    GridTable rescreen; // (age5, total) -> (shape, scale, cure)
     NumericInterpolate interp_prob_grade7;
-    H_dist_t H_dist;
-    H_local_t H_local;
-    set<double,greater<double> > H_local_age_set;
+    SurvivalTable H_dist, H_local; // by (age band, grade); H_dist has one age band
 
     Rng * rngNh, * rngOther, * rngScreen, * rngTreatment;
     Rpexp rmu0;
 
-    NumericVector parameter;
-    LogicalVector bparameter;
+    NamedNumeric parameter;
+    NamedLogical bparameter;
+    Parameters par; // resolved from parameter and bparameter
 
     // read in the parameters
-    NumericVector cost_parameters, utility_estimates, utility_duration, lost_production_years;
-    NumericVector mubeta2, sebeta2; // otherParameters["mubeta2"] rather than as<NumericVector>(otherParameters["mubeta2"])
+    // by Category::Type; NA if the category is not named in the parameters
+    double cost_parameters[Category::N], utility_estimates[Category::N],
+      utility_duration[Category::N], lost_production_years[Category::N];
+    NamedNumeric mubeta2, sebeta2; // otherParameters["mubeta2"] rather than as<NumericVector>(otherParameters["mubeta2"])
     int screen, nLifeHistories;
+    vector<int> screens; // scenarios run on the same men (screen is the first)
+    vector<ScreeningPolicy> policies; // by scenario
     bool panel, debug;
     Table<double,double> production;
 
+    SimInput() : rngNh(NULL), rngOther(NULL), rngScreen(NULL), rngTreatment(NULL) {}
     ~SimInput() {
       if (rngNh != NULL) delete rngNh;
       if (rngOther != NULL) delete rngOther;
@@ -164,6 +1326,37 @@ namespace fhcrc_example {
     int id;
     double utility;
   };
+  /**
+     Age-specific background utilities (lower age bound and value); see
+     FhcrcPerson::init()
+  */
+  namespace BackgroundUtility {
+    const int N = 14;
+    const double ages[N] = {0.0, 18.0, 25.0, 30.0, 35.0, 40.0, 45.0, 50.0,
+			    55.0, 60.0, 65.0, 70.0, 75.0, 80.0};
+    const double values[N] = {1.00, 0.89, 0.89, 0.88, 0.87, 0.84, 0.84, 0.83,
+			      0.83, 0.82, 0.83, 0.81, 0.79, 0.74};
+    /** Background utility at a given age */
+    inline double value(double age) {
+      int i = int(upper_bound(ages, ages+N, age) - ages) - 1;
+      return i < 0 ? 1.0 : values[i];
+    }
+    /** The first age after age at which the background utility changes */
+    inline double next_change(double age) {
+      const double* it = upper_bound(ages, ages+N, age);
+      return it == ages+N ? R_PosInf : *it;
+    }
+  }
+
+  /**
+     @brief Active utility decrements, with their combined value kept up
+     to date as decrements are added and removed.
+
+     The combined value is recomputed over the decrements when one is
+     added or removed, in the same order and with the same arithmetic as
+     the scan that utility() used to do, so reads are O(1) and the
+     results do not change.
+  */
   class Utilities {
   public:
     typedef boost::unordered_map<int,double> UMap;
@@ -171,32 +1364,50 @@ namespace fhcrc_example {
     int counter;
     utility_scale_t scale;
     bool truncate;
-    Utilities(utility_scale_t scale = UtilityMultiplicative, bool truncate = true) :counter(0), scale(scale), truncate(truncate) {}
-    double utility() {
+    bool background; // include the background utilities as a function of age
+    Utilities(utility_scale_t scale = UtilityMultiplicative, bool truncate = true, bool background = false) :
+      counter(0), scale(scale), truncate(truncate), background(background), combined(1.0) {}
+    double combine(double value, double u) {
+      if (scale == UtilityAdditive)
+	value -= (1.0 - u);
+      else if (scale == UtilityMultiplicative)
+	value *= u;
+      else if (scale == UtilityMinimum) {
+	if (u < value) value = u;
+      }
+      return value;
+    }
+    double utility(double age = 0.0) {
       // case: no utilities?
       // case: value>1.0?
-      double value = 1.0;
-      for (UMap::iterator it = umap.begin(); it!=umap.end(); it++) {
-	if (scale == UtilityAdditive)
-	  value -= (1.0 - it->second);
-	else if (scale == UtilityMultiplicative)
-	  value *= it->second;
-	else if (scale == UtilityMinimum) {
-	  if (it->second < value) value = it->second;
-	}
-      }
+      double value = combined;
+      if (background)
+	value = combine(value, BackgroundUtility::value(age));
       if (truncate && value < 0.0) value = 0.0;
       return value;
     }
-    void clear() { umap.clear(); counter = 0; }
+    void clear() { umap.clear(); counter = 0; combined = 1.0; }
+    void add(int id, double u) {
+      umap[id] = u;
+      update();
+    }
+    void erase(int id) {
+      if (umap.erase(id) > 0) update();
+    }
     void handleMessage(const cMessage* msg) {
-      const cMessageUtility * umsg;
-      if ((umsg = dynamic_cast<const cMessageUtility *>(msg)) != 0) {
-	if (umsg->kind == toUtilityChange)
-	  umap[umsg->id] = umsg->utility;
-	else if (umsg->kind == toUtilityRemove)
-	  umap.erase(umsg->id);
-      }
+      // only cMessageUtility messages have these kinds
+      const cMessageUtility * umsg = static_cast<const cMessageUtility *>(msg);
+      if (umsg->kind == toUtilityChange)
+	add(umsg->id, umsg->utility);
+      else if (umsg->kind == toUtilityRemove)
+	erase(umsg->id);
+    }
+  private:
+    double combined; // the decrements combined, without the background
+    void update() {
+      combined = 1.0;
+      for (UMap::iterator it = umap.begin(); it!=umap.end(); it++)
+	combined = combine(combined, it->second);
     }
   };
   void Rprint(Utilities utilities) {
@@ -210,17 +1421,652 @@ namespace fhcrc_example {
     Rprintf("]\n");
   }
 
-  template<class T>
-  T bounds(T x, T a, T b) {
-    return (x<a)?a:((x>b)?b:x);
-  }
+  template<class T>
+  T bounds(T x, T a, T b) {
+    return (x<a)?a:((x>b)?b:x);
+  }
+
+  /**
+     @brief Arena of fixed-size blocks for the messages of one queue.
+
+     Released blocks go onto a free list, and reset() recycles all of
+     the blocks at once between men; the chunks are only returned to
+     the heap when the pool is destroyed.
+  */
+  class MessagePool {
+  public:
+    enum {ChunkBlocks = 256};
+    static size_t blockSize() {
+      size_t size = max(sizeof(cMessage), sizeof(cMessageUtility));
+      const size_t align = 16;
+      return (size + align - 1) / align * align;
+    }
+    MessagePool() : used(0) {}
+    ~MessagePool() {
+      for (size_t i = 0; i < chunks.size(); ++i)
+	::operator delete(chunks[i]);
+    }
+    void* allocate() { // a block of blockSize()
+      if (!freeList.empty()) {
+	void* block = freeList.back();
+	freeList.pop_back();
+	return block;
+      }
+      if (used == chunks.size() * ChunkBlocks)
+	chunks.push_back(static_cast<char*>(::operator new(ChunkBlocks * blockSize())));
+      void* block = chunks[used / ChunkBlocks] + (used % ChunkBlocks) * blockSize();
+      used++;
+      return block;
+    }
+    void release(void* block) { freeList.push_back(block); }
+    void reset() {
+      used = 0;
+      freeList.clear();
+    }
+  private:
+    vector<char*> chunks;
+    size_t used;
+    vector<void*> freeList;
+    MessagePool(const MessagePool&);
+    MessagePool& operator=(const MessagePool&);
+  };
+
+  /**
+     @brief Event queue for the man currently simulated by a worker.
+
+     This replaces the global ssim::Sim scheduler, so that each worker
+     thread can run its own simulation. The queue is the same binary heap
+     on the event times as in ssim, with the same comparisons, so events
+     at the same time are handled in the same order as before.
+
+     Removing events by kind is lazy: the queue records the schedule
+     counter at removal for each kind, and events of that kind scheduled
+     earlier are discarded when they reach the front of the queue. As
+     with ssim's ignore_event, the heap keeps its shape.
+
+     Messages are allocated from the queue's MessagePool with create()
+     or placement new on allocate(), and are destroyed by the queue.
+
+     With calendar set, events in [0, Horizon) years are kept in one
+     bucket per year, in time and schedule order, and other times in the
+     heap. A man's events are mostly scheduled in time order within a
+     bounded life course, so an insert is usually an append and a pop is
+     from the front of the current bucket. The buckets keep their memory
+     between men. Events at the same time are then handled in schedule
+     order, whereas the heap's order for ties depends on its shape, so
+     the two queues can give different (equally valid) results.
+  */
+  class EventQueue {
+  public:
+    enum {MaxKinds = 32}; // kinds are bits in an unsigned long
+    enum {Horizon = 128}; // calendar buckets, one per year of age
+    struct Entry {
+      double time;
+      long order;
+      cMessage* msg;
+    };
+    struct Bucket {
+      vector<Entry> entries; // in time and schedule order from head
+      size_t head;
+      Bucket() : head(0) {}
+      bool empty() const { return head == entries.size(); }
+    };
+    vector<Entry> heap; // all events, or those outside the calendar
+    Bucket buckets[Horizon];
+    int current; // no calendar events before this bucket
+    long pending; // events in the queue, including removed events
+    bool calendar;
+    double clock;
+    long counter;
+    bool stopped;
+    long removedBefore[MaxKinds]; // events of a kind with order < removedBefore[kind] are removed
+    Profile* profile; // NULL unless profiling
+    MessagePool pool;
+    void* allocate() { return pool.allocate(); } // fits a cMessage or cMessageUtility
+    cMessage* create(short kind) { return new (allocate()) cMessage(kind); }
+    void destroy(cMessage* msg) {
+      msg->~cMessage();
+      pool.release(msg);
+    }
+    EventQueue() : current(Horizon), pending(0), calendar(false), clock(0.0), counter(0),
+		   stopped(false), profile(NULL) {
+      fill(removedBefore, removedBefore+MaxKinds, 0L);
+    }
+    ~EventQueue() { clear(); }
+    /** Schedule msg at time t (as a delay of t - now(), as in ssim) */
+    void scheduleAt(double t, cMessage* msg) {
+      msg->timestamp = t;
+      msg->sendingTime = clock;
+      Entry entry = {clock + (t - clock), counter++, msg};
+      if (profile && profile->valid(msg->kind)) profile->allocations[msg->kind]++;
+      pending++;
+      if (calendar && t >= 0.0 && t < Horizon) {
+	int index = int(t);
+	vector<Entry>& entries = buckets[index].entries;
+	// usually the latest event in the bucket, so scan from the back
+	size_t pos = entries.size();
+	while (pos > buckets[index].head && later(entries[pos-1], entry)) --pos;
+	entries.insert(entries.begin() + pos, entry);
+	if (index < current) current = index;
+      }
+      else pushHeap(entry);
+    }
+    /** Take the next event from the calendar or the heap */
+    Entry pop() {
+      pending--;
+      while (current < Horizon && buckets[current].empty()) {
+	buckets[current].entries.clear();
+	buckets[current].head = 0;
+	current++;
+      }
+      if (current < Horizon) {
+	Bucket& bucket = buckets[current];
+	if (heap.empty() || !(heap.front().time < bucket.entries[bucket.head].time))
+	  return bucket.entries[bucket.head++];
+      }
+      return popHeap();
+    }
+    bool empty() const { return pending == 0; }
+    long size() const { return pending; }
+    bool removed(const Entry& entry) const {
+      short kind = entry.msg->kind;
+      return kind >= 0 && kind < MaxKinds && entry.order < removedBefore[kind];
+    }
+    /** Remove all pending events with a kind in the set of kind_bit()s */
+    void RemoveKinds(unsigned long kinds) {
+      for (int kind = 0; kind < MaxKinds; ++kind)
+	if (kinds & kind_bit(kind)) removedBefore[kind] = counter;
+    }
+    void RemoveKind(short kind) { RemoveKinds(kind_bit(kind)); }
+    double now() const { return clock; }
+    void stop_simulation() { stopped = true; }
+    /**
+       Run the simulation for one process: initialise, then handle the
+       events in time order until the queue is empty or stopped.
+    */
+    template<class Process>
+    void run_simulation(Process& process) {
+      clock = 0.0;
+      stopped = false;
+      process.previousEventTime = clock;
+      double start = profile ? wall_time() : 0.0;
+      long handled = 0;
+      process.init();
+      if (profile) {
+	profile->initTime += wall_time() - start;
+	profile->persons++;
+      }
+      while (!stopped && !empty()) {
+	if (profile) profile->queueSize[size()]++;
+	Entry entry = pop();
+	if (removed(entry)) {
+	  destroy(entry.msg);
+	  continue;
+	}
+	clock = entry.time;
+	if (profile) start = wall_time();
+	process.handleMessage(entry.msg);
+	if (profile && profile->valid(entry.msg->kind)) {
+	  profile->time[entry.msg->kind] += wall_time() - start;
+	  profile->events[entry.msg->kind]++;
+	}
+	handled++;
+	process.previousEventTime = clock;
+	destroy(entry.msg);
+      }
+      if (profile) profile->eventsPerPerson[handled]++;
+    }
+    void clear() {
+      for (vector<Entry>::iterator it = heap.begin(); it != heap.end(); ++it)
+	destroy(it->msg);
+      heap.clear();
+      for (; current < Horizon; ++current) { // later buckets are empty
+	Bucket& bucket = buckets[current];
+	for (size_t i = bucket.head; i < bucket.entries.size(); ++i)
+	  destroy(bucket.entries[i].msg);
+	bucket.entries.clear();
+	bucket.head = 0;
+      }
+      pending = 0;
+      pool.reset();
+      counter = 0;
+      clock = 0.0;
+      fill(removedBefore, removedBefore+MaxKinds, 0L);
+    }
+    static bool earlier(const Entry& a, const Entry& b) { return a.time < b.time; }
+    void Rprint_actions() {
+      vector<Entry> sorted;
+      for (vector<Entry>::iterator it = heap.begin(); it != heap.end(); ++it)
+	if (!removed(*it)) sorted.push_back(*it);
+      for (int index = current; index < Horizon; ++index)
+	for (size_t i = buckets[index].head; i < buckets[index].entries.size(); ++i)
+	  if (!removed(buckets[index].entries[i])) sorted.push_back(buckets[index].entries[i]);
+      stable_sort(sorted.begin(), sorted.end(), earlier);
+      Rprintf("actions: [");
+      for (vector<Entry>::iterator it = sorted.begin(); it != sorted.end(); ++it) {
+	if (it != sorted.begin()) Rprintf(",");
+	Rprintf("(%f,%i)", it->time, it->msg->kind);
+      }
+      Rprintf("]\n");
+    }
+  private:
+    static bool later(const Entry& a, const Entry& b) {
+      return a.time > b.time || (a.time == b.time && a.order > b.order);
+    }
+    /** The binary heap on the event times, with the ssim comparisons */
+    void pushHeap(const Entry& entry) {
+      size_t i = heap.size();
+      heap.push_back(entry);
+      for (size_t parent; i > 0 && entry.time < heap[parent = (i - 1) / 2].time; i = parent)
+	heap[i] = heap[parent];
+      heap[i] = entry;
+    }
+    Entry popHeap() {
+      Entry first = heap.front(), last = heap.back();
+      heap.pop_back();
+      size_t n = heap.size(), i = 0;
+      if (n > 0) {
+	for (size_t child; (child = 2 * i + 1) < n; i = child) {
+	  if (child + 1 < n && heap[child + 1].time < heap[child].time) ++child;
+	  if (!(heap[child].time < last.time)) break;
+	  heap[i] = heap[child];
+	}
+	heap[i] = last;
+      }
+      return first;
+    }
+  };
+
+  // Substream transition matrices for the two MRG components (from RngStream.cpp)
+  namespace rngstream {
+    typedef boost::uint64_t Matrix[3][3];
+    const boost::uint64_t m1 = 4294967087UL, m2 = 4294944443UL;
+    const Matrix A1p76 = {
+      {      82758667UL, 1871391091UL, 4127413238UL },
+      {    3672831523UL,   69195019UL, 1871391091UL },
+      {    3672091415UL, 3528743235UL,   69195019UL }
+    };
+    const Matrix A2p76 = {
+      {    1511326704UL, 3759209742UL, 1610795712UL },
+      {    4292754251UL, 1511326704UL, 3889917532UL },
+      {    3859662829UL, 4292754251UL, 3708466080UL }
+    };
+    // C = A*B mod m; works if C is A or B
+    void MatMatModM(const Matrix A, const Matrix B, Matrix C, boost::uint64_t m) {
+      Matrix W;
+      for (int i = 0; i < 3; ++i)
+	for (int j = 0; j < 3; ++j) {
+	  W[i][j] = 0;
+	  for (int k = 0; k < 3; ++k)
+	    W[i][j] = (W[i][j] + A[i][k] * B[k][j] % m) % m;
+	}
+      for (int i = 0; i < 3; ++i)
+	for (int j = 0; j < 3; ++j)
+	  C[i][j] = W[i][j];
+    }
+    // B = A^n mod m
+    void MatPowModM(const Matrix A, Matrix B, boost::uint64_t m, long n) {
+      Matrix W;
+      for (int i = 0; i < 3; ++i)
+	for (int j = 0; j < 3; ++j) {
+	  W[i][j] = A[i][j];
+	  B[i][j] = (i == j) ? 1 : 0;
+	}
+      for (; n > 0; n /= 2) {
+	if (n % 2) MatMatModM(W, B, B, m);
+	MatMatModM(W, W, W, m);
+      }
+    }
+  }
+
+  /**
+     @brief Jump a stream forward n substreams from the start of its
+     current substream (equivalent to n calls to ResetNextSubstream()).
+  */
+  void advanceSubstreams(RngStream& rng, long n) {
+    unsigned long seed[6], next[6];
+    rngstream::Matrix B1, B2;
+    rng.ResetStartSubstream();
+    rng.GetState(seed);
+    rngstream::MatPowModM(rngstream::A1p76, B1, rngstream::m1, n);
+    rngstream::MatPowModM(rngstream::A2p76, B2, rngstream::m2, n);
+    for (int i = 0; i < 3; ++i) {
+      boost::uint64_t s1 = 0, s2 = 0;
+      for (int j = 0; j < 3; ++j) {
+	s1 = (s1 + B1[i][j] * seed[j] % rngstream::m1) % rngstream::m1;
+	s2 = (s2 + B2[i][j] * seed[j+3] % rngstream::m2) % rngstream::m2;
+      }
+      next[i] = (unsigned long) s1;
+      next[i+3] = (unsigned long) s2;
+    }
+    rng.SetSeed(next);
+  }
+
+  /**
+     @brief Random number streams for one worker.
+
+     These are copies of the rngNh, rngOther, rngScreen and rngTreatment
+     streams in SimInput, moved to the substream of the current man. The
+     samplers reproduce R's algorithms (user unif_rand, normal by
+     inversion, exp_rand, rgamma) and microsimulation's truncated normal
+     and log-logistic draws on the current stream, so that each man gets
+     the same draws as through R's user RNG hook without touching R's
+     global RNG state. No R functions are called: the normal quantile is
+     a copy of R's qnorm (Wichura's AS241).
+  */
+  class WorkerRng {
+  public:
+    vector<const RngStream*> base;
+    vector<RngStream> streams;
+    RngStream* current;
+    WorkerRng(const SimInput& in) {
+      base.push_back(in.rngNh);
+      base.push_back(in.rngOther);
+      base.push_back(in.rngScreen);
+      base.push_back(in.rngTreatment);
+      for (size_t i = 0; i < base.size(); ++i)
+	streams.push_back(*base[i]);
+      current = &streams[NhStream];
+      aa = aaa = 0.0;
+    }
+    void set(stream_t stream) { current = &streams[stream]; }
+    const RngStream& state(stream_t stream) const { return streams[stream]; }
+    void restore(stream_t stream, const RngStream& state) { streams[stream] = state; }
+    /** Move all streams to substream n of the initial streams */
+    void seek(long n) {
+      for (size_t i = 0; i < streams.size(); ++i) {
+	streams[i] = *base[i];
+	advanceSubstreams(streams[i], n);
+      }
+    }
+    void nextSubstream() {
+      for (size_t i = 0; i < streams.size(); ++i)
+	streams[i].ResetNextSubstream();
+    }
+    double unif_rand() { return current->RandU01(); }
+    double norm_rand() {
+      const double BIG = 134217728; /* 2^27 */
+      double u = unif_rand();
+      u = (int)(BIG*u) + unif_rand();
+      return qnorm(u/BIG);
+    }
+    static double qnorm(double p);
+    double exp_rand();
+    double runif(double a, double b) {
+      if (a == b) return a;
+      double u;
+      do { u = unif_rand(); } while (u <= 0 || u >= 1);
+      return a + (b - a) * u;
+    }
+    double rnorm(double mu, double sigma) {
+      return (sigma == 0.0) ? mu : mu + sigma * norm_rand();
+    }
+    double rnormPos(double mu, double sigma) {
+      double x;
+      while ((x = rnorm(mu, sigma)) < 0.0) { }
+      return x;
+    }
+    double rexp(double scale) { return scale * exp_rand(); }
+    double rlnorm(double meanlog, double sdlog) { return exp(rnorm(meanlog, sdlog)); }
+    double rweibull(double shape, double scale) {
+      return scale * pow(-log(unif_rand()), 1./shape);
+    }
+    double rllogis(double shape, double scale) {
+      double u = runif(0.0, 1.0);
+      return scale*exp(-log(1.0/u-1.0)/shape);
+    }
+    double rllogis_trunc(double shape, double scale, double left) {
+      double S0 = 1.0/(1.0+exp(log(left/scale)*shape));
+      double u = runif(0.0, 1.0);
+      return scale*exp(log(1.0/(u*S0)-1.0)/shape);
+    }
+    double rgamma(double a, double scale);
+  private:
+    // cached values for rgamma (static variables in R's rgamma.c)
+    double aa, aaa, s, s2, d, q0, b, si, c;
+  };
+
+  /**
+     Standard normal quantile for 0 < p < 1, as per qnorm() in R's
+     nmath/qnorm.c (Wichura's algorithm AS241)
+  */
+  double WorkerRng::qnorm(double p) {
+    double q = p - 0.5, r, val;
+    if (fabs(q) <= .425) { /* 0.075 <= p <= 0.925 */
+      r = .180625 - q * q;
+      val =
+	q * (((((((r * 2509.0809287301226727 +
+		   33430.575583588128105) * r + 67265.770927008700853) * r +
+		 45921.953931549871457) * r + 13731.693765509461125) * r +
+	       1971.5909503065514427) * r + 133.14166789178437745) * r +
+	     3.387132872796366608)
+	/ (((((((r * 5226.495278852545925 +
+		 28729.085735721942674) * r + 39307.89580009271061) * r +
+	       21213.794301586595867) * r + 5394.1960214247511077) * r +
+	     687.1870074920579083) * r + 42.313330701600911252) * r + 1.);
+    }
+    else { /* closer than 0.075 from {0,1} boundary */
+      r = (q > 0) ? (0.5 - p + 0.5) : p; /* min(p, 1-p) */
+      r = sqrt(- log(r));
+      if (r <= 5.) {
+	r += -1.6;
+	val = (((((((r * 7.7454501427834140764e-4 +
+		     .0227238449892691845833) * r + .24178072517745061177) *
+		   r + 1.27045825245236838258) * r +
+		  3.64784832476320460504) * r + 5.7694972214606914055) *
+		r + 4.6303378461565452959) * r +
+	       1.42343711074968357734)
+	  / (((((((r *
+		   1.05075007164441684324e-9 + 5.475938084995344946e-4) *
+		  r + .0151986665636164571966) * r +
+		 .14810397642748007459) * r + .68976733498510000455) *
+	       r + 1.6763848301838038494) * r +
+	      2.05319162663775882187) * r + 1.);
+      }
+      else { /* very close to 0 or 1 */
+	r += -5.;
+	val = (((((((r * 2.01033439929228813265e-7 +
+		     2.71155556874348757815e-5) * r +
+		    .0012426609473880784386) * r + .026532189526576123093) *
+		  r + .29656057182850489123) * r +
+		 1.7848265399172913358) * r + 5.4637849111641143699) *
+	       r + 6.6579046435011037772)
+	  / (((((((r *
+		   2.04426310338993978564e-15 + 1.4215117583164458887e-7)*
+		  r + 1.8463183175100546818e-5) * r +
+		 7.868691311456132591e-4) * r + .0148753612908506148525)
+	       * r + .13692988092273580531) * r +
+	      .59983220655588793769) * r + 1.);
+      }
+      if (q < 0.0)
+	val = -val;
+    }
+    return val;
+  }
+
+  /**
+     Exponential deviate, as per exp_rand() in R's nmath/sexp.c
+  */
+  double WorkerRng::exp_rand() {
+    /* q[k-1] = sum(log(2)^k / k!)  k=1,..,n, */
+    const static double q[] = {
+      0.6931471805599453,
+      0.9333736875190459,
+      0.9888777961838675,
+      0.9984959252914960040,
+      0.9998292811061389,
+      0.9999833164100727,
+      0.9999985508193391,
+      0.9999998906925558,
+      0.9999999924734159,
+      0.9999999995283275,
+      0.9999999999728814,
+      0.9999999999985598,
+      0.9999999999999289,
+      0.9999999999999968,
+      0.9999999999999999,
+      1.0000000000000000
+    };
+    double a = 0.;
+    double u = unif_rand();
+    while (u <= 0. || u >= 1.) u = unif_rand();
+    for (;;) {
+      u += u;
+      if (u > 1.)
+	break;
+      a += q[0];
+    }
+    u -= 1.;
+    if (u <= q[0])
+      return a + u;
+    int i = 0;
+    double ustar = unif_rand(), umin = ustar;
+    do {
+      ustar = unif_rand();
+      if (umin > ustar)
+	umin = ustar;
+      i++;
+    } while (u > q[i]);
+    return a + umin * q[0];
+  }
+
+  /**
+     Gamma deviate, as per rgamma() in R's nmath/rgamma.c (Ahrens and
+     Dieter's GS and GD algorithms)
+  */
+  double WorkerRng::rgamma(double a, double scale) {
+    const static double sqrt32 = 5.656854;
+    const static double exp_m1 = 0.36787944117144233;/* exp(-1) = 1/e */
+    const static double q1 = 0.04166669, q2 = 0.02083148, q3 = 0.00801191,
+      q4 = 0.00144121, q5 = -7.388e-5, q6 = 2.4511e-4, q7 = 2.424e-4;
+    const static double a1 = 0.3333333, a2 = -0.250003, a3 = 0.2000062,
+      a4 = -0.1662921, a5 = 0.1423657, a6 = -0.1367177, a7 = 0.1233795;
+    double e, p, q, r, t, u, v, w, x, ret_val;
+    if (a <= 0.0 || scale <= 0.0) return 0.0;
+    if (a < 1.) { /* GS algorithm for parameters a < 1 */
+      e = 1.0 + exp_m1 * a;
+      for (;;) {
+	p = e * unif_rand();
+	if (p >= 1.0) {
+	  x = -log((e - p) / a);
+	  if (exp_rand() >= (1.0 - a) * log(x))
+	    break;
+	} else {
+	  x = exp(log(p) / a);
+	  if (exp_rand() >= x)
+	    break;
+	}
+      }
+      return scale * x;
+    }
+    /* --- a >= 1 : GD algorithm --- */
+    /* Step 1: Recalculations of s2, s, d if a has changed */
+    if (a != aa) {
+      aa = a;
+      s2 = a - 0.5;
+      s = sqrt(s2);
+      d = sqrt32 - s * 12.;
+    }
+    /* Step 2: t = standard normal deviate, x = (s,1/2) -normal deviate. */
+    /* immediate acceptance (i) */
+    t = norm_rand();
+    x = s + 0.5 * t;
+    ret_val = x * x;
+    if (t >= 0.)
+      return scale * ret_val;
+    /* Step 3: u = 0,1 - uniform sample. squeeze acceptance (s) */
+    u = unif_rand();
+    if (d * u <= t * t * t)
+      return scale * ret_val;
+    /* Step 4: recalculations of q0, b, si, c if necessary */
+    if (a != aaa) {
+      aaa = a;
+      r = 1. / a;
+      q0 = ((((((q7 * r + q6) * r + q5) * r + q4) * r + q3) * r
+	     + q2) * r + q1) * r;
+      if (a <= 3.686) {
+	b = 0.463 + s + 0.178 * s2;
+	si = 1.235;
+	c = 0.195 / s - 0.079 + 0.16 * s;
+      } else if (a <= 13.022) {
+	b = 1.654 + 0.0076 * s2;
+	si = 1.68 / s + 0.275;
+	c = 0.062 / s + 0.024;
+      } else {
+	b = 1.77;
+	si = 0.75;
+	c = 0.1515 / s;
+      }
+    }
+    /* Step 5: no quotient test if x not positive */
+    if (x > 0.) {
+      /* Step 6: calculation of v and quotient q */
+      v = t / (s + s);
+      if (fabs(v) <= 0.25)
+	q = q0 + 0.5 * t * t * ((((((a7 * v + a6) * v + a5) * v + a4) * v
+				  + a3) * v + a2) * v + a1) * v;
+      else
+	q = q0 - s * t + 0.25 * t * t + (s2 + s2) * log(1.0 + v);
+      /* Step 7: quotient acceptance (q) */
+      if (log(1.0 - u) <= q)
+	return scale * ret_val;
+    }
+    for (;;) {
+      /* Step 8: e = standard exponential deviate
+       *	u =  0,1 -uniform deviate
+       *	t = (b,si)-double exponential (laplace) sample */
+      e = exp_rand();
+      u = unif_rand();
+      u = u + u - 1.0;
+      if (u < 0.0)
+	t = b - si * e;
+      else
+	t = b + si * e;
+      /* Step	 9:  rejection if t < tau(1) = -0.71874483771719 */
+      if (t >= -0.71874483771719) {
+	/* Step 10:	 calculation of v and quotient q */
+	v = t / (s + s);
+	if (fabs(v) <= 0.25)
+	  q = q0 + 0.5 * t * t *
+	    ((((((a7 * v + a6) * v + a5) * v + a4) * v + a3) * v
+	      + a2) * v + a1) * v;
+	else
+	  q = q0 - s * t + 0.25 * t * t + (s2 + s2) * log(1.0 + v);
+	/* Step 11:	 hat acceptance (h) */
+	/* (if q not positive go to step 8) */
+	if (q > 0.0) {
+	  w = expm1(q);
+	  /*  ^^^^^ original code had approximation with rel.err < 2e-7 */
+	  /* if t is rejected sample again at step 8 */
+	  if (c * fabs(u) <= w * exp(e - 0.5 * t * t))
+	    break;
+	}
+      }
+    } /* repeat .. until  `t' is accepted */
+    x = s + 0.5 * t;
+    return scale * x * x;
+  }
+
+  /**
+     @brief A man's natural history: the values drawn from the NhStream
+     at the start of his life, and the state of that stream afterwards.
+  */
+  struct NaturalHistory {
+    double t0, beta0, beta1, beta2, y0, t3p, tm, tc, tmc, aoc;
+    base::grade_t future_grade;
+    ext::grade_t future_ext_grade;
+    RngStream nhStream;
+  };
 
-  class FhcrcPerson : public cProcess
+  class FhcrcPerson
   {
   public:
     SimInput* in;
     SimOutput* out;
     Utilities* utilities;
+    EventQueue* queue;
+    WorkerRng* rng;
+    double previousEventTime;
     double beta0, beta1, beta2;
     double t0, y0, t3p, tm, tc, tmc, aoc;
     state_t state;
@@ -234,9 +2080,31 @@ namespace fhcrc_example {
     int id;
     double cohort, rescreening_frailty;
     bool everPSA, previousNegativeBiopsy, organised;
-    FhcrcPerson(SimInput* in, SimOutput* out, Utilities* utilities, const int id = 0, const double cohort = 1950) :
-      in(in), out(out), utilities(utilities), id(id), cohort(cohort) { };
-    double utility() { return utilities->utility(); }
+    const NaturalHistory* natural; // drawn in advance, or NULL
+    int screen; // screen_t scenario
+    const ScreeningPolicy* policy; // for the scenario
+    FhcrcPerson(SimInput* in, SimOutput* out, Utilities* utilities, EventQueue* queue, WorkerRng* rng,
+		const int id = 0, const double cohort = 1950, const NaturalHistory* natural = NULL) :
+      in(in), out(out), utilities(utilities), queue(queue), rng(rng), previousEventTime(0.0),
+      id(id), cohort(cohort), natural(natural), screen(in->screen), policy(&in->policies[0]) { };
+    void setPolicy(const ScreeningPolicy& p) { policy = &p; screen = p.screen; }
+    /** Is the man healthy until his other-cause death, and never screened? */
+    bool healthyLife_p() const {
+      return in->par.analytic_healthy && utilities->background && screen == noScreening &&
+	natural != NULL && natural->t0 + 35.0 > natural->aoc && id >= in->nLifeHistories;
+    }
+    void healthyLife();
+    // utility since the previous event
+    double utility() { return utilities->utility(previousEventTime); }
+    void record(short kind, double lhs, double rhs, double psa, double utility);
+    double now() const { return queue->now(); }
+    void scheduleAt(double t, cMessage* msg) { queue->scheduleAt(t, msg); }
+    void scheduleAt(double t, short kind) { queue->scheduleAt(t, queue->create(kind)); }
+    cMessageUtility* utilityMessage(short kind, int id, double utility = 1.0) {
+      return new (queue->allocate()) cMessageUtility(kind, id, utility);
+    }
+    void RemoveKind(short kind) { queue->RemoveKind(kind); }
+    void RemoveKinds(unsigned long kinds) { queue->RemoveKinds(kinds); }
     double psamean(double age);
     double psameasured(double age);
     treatment_t calculate_treatment(double u, double age, double year);
@@ -250,10 +2118,13 @@ namespace fhcrc_example {
     void rescreening_schedules(double psa, bool organised, bool mixed_programs);
     bool detectable(double now, double year);
     void init();
-    void add_costs(string item, cost_t cost_type = Direct, double weight=1.0);
-    void lost_productivity(string item, double weight=1.0);
-    virtual void handleMessage(const cMessage* msg);
-    void scheduleUtilityChange(double at, std::string category);
+    void sampleNaturalHistory();
+    NaturalHistory naturalHistory() const;
+    void setNaturalHistory(const NaturalHistory& nh);
+    void add_costs(Category::Type item, cost_t cost_type = Direct, double weight=1.0);
+    void lost_productivity(Category::Type item, double weight=1.0);
+    void handleMessage(const cMessage* msg);
+    void scheduleUtilityChange(double at, Category::Type category);
     void scheduleUtilityChange(double at, double utility);
     void scheduleUtilityChange(double from, double to, double utility);
     bool onset_p();
@@ -273,59 +2144,58 @@ namespace fhcrc_example {
       Calculate the *measured* PSA value at a given age (** NB: this used to be t=age-35 **)
   */
   double FhcrcPerson::psameasured(double age) {
-    return FhcrcPerson::psamean(age)*exp(R::rnorm(0.0, sqrt(double(in->parameter["tau2"]))));
+    return FhcrcPerson::psamean(age)*exp(rng->rnorm(0.0, sqrt(double(in->par.tau2))));
     }
 
   /**
       Report on costs for a given item
   */
-  void FhcrcPerson::add_costs(string item, cost_t cost_type, double weight) {
-    out->costs.add(CostKey((int) cost_type,item),now(),in->cost_parameters[item] * weight);
+  void FhcrcPerson::add_costs(Category::Type item, cost_t cost_type, double weight) {
+    out->costs.add(cost_type,item,now(),in->cost_parameters[item] * weight);
+    if (cost_type == Direct)
+      out->outcome[Outcome::costs] += out->costs.discounted(now(), in->cost_parameters[item] * weight);
   }
 
   /**
       Report on lost productivity
   */
-  void FhcrcPerson::lost_productivity(string item, double weight) {
+  void FhcrcPerson::lost_productivity(Category::Type item, double weight) {
     double loss = in->lost_production_years[item] * in->production(now()) * weight;
-    out->costs.add(CostKey((int) Indirect,item),now(),loss);
+    out->costs.add(Indirect,item,now(),loss);
   }
 
   /**
      Schedule a utility change.
    **/
-  void FhcrcPerson::scheduleUtilityChange(double at, std::string category) {
+  void FhcrcPerson::scheduleUtilityChange(double at, Category::Type category) {
     utilities->counter++; // increment
-    scheduleAt(at, new cMessageUtility(toUtilityChange,
-				       utilities->counter,
-				       in->utility_estimates[category]));
+    scheduleAt(at, utilityMessage(toUtilityChange,
+				  utilities->counter,
+				  in->utility_estimates[category]));
     scheduleAt(at + in->utility_duration[category],
-	       new cMessageUtility(toUtilityRemove, utilities->counter));
+	       utilityMessage(toUtilityRemove, utilities->counter));
   }
   void FhcrcPerson::scheduleUtilityChange(double from, double to, double utility) {
     utilities->counter++; // increment
-    scheduleAt(from, new cMessageUtility(toUtilityChange, utilities->counter, utility));
-    scheduleAt(to, new cMessageUtility(toUtilityRemove, utilities->counter));
+    scheduleAt(from, utilityMessage(toUtilityChange, utilities->counter, utility));
+    scheduleAt(to, utilityMessage(toUtilityRemove, utilities->counter));
   }
 
   treatment_t FhcrcPerson::calculate_treatment(double u, double age, double year) {
     double pCM, pRP, pRT;
+    const double* prtx;
     // treatment probabilities in 2008
-    if (in->bparameter["stockholmTreatment"]) {
-       pCM = in->prtxCM(bounds<double>(age,50.0,85.0),
-		    bounds<double>(year,2008.0,2012.0),
-		    int(ext_grade));
-       pRP = in->prtxRP(bounds<double>(age,50.0,85.0),
-		    bounds<double>(year,2008.0,2012.0),
-		    int(ext_grade));
+    if (in->par.stockholmTreatment) {
+       prtx = in->prtx(bounds<double>(age,50.0,85.0),
+		       bounds<double>(year,2008.0,2012.0),
+		       int(ext_grade));
     } else { // original FHCRC table prtx
-       pCM = in->prtxCM(bounds<double>(age,50.0,79.0),
-		    bounds<double>(year,1973.0,2004.0),
-		    int(grade));
-       pRP = in->prtxRP(bounds<double>(age,50.0,79.0),
-		    bounds<double>(year,1973.0,2004.0),
-		    int(grade));
+       prtx = in->prtx(bounds<double>(age,50.0,79.0),
+		       bounds<double>(year,1973.0,2004.0),
+		       int(grade));
     }
+    pCM = prtx[PrtxCM];
+    pRP = prtx[PrtxRP];
     pRT = 1.0 - pCM - pRP;
     // adjust for secular trend in odds of RP or RT
     {
@@ -363,8 +2233,8 @@ namespace fhcrc_example {
     bool localised = (age_diag < age_m);
     double mort_hr;
     if (localised) {
-      mort_hr = in->hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext_grade, psamean(age_diag)>10 ? 1 : 0);
-      if (ext_state == ext::T3plus) mort_hr*=double(in->parameter["RR_T3plus"]);
+      mort_hr = in->hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext_grade, psamean(age_diag)>10 ? 1 : 0)[0];
+      if (ext_state == ext::T3plus) mort_hr*=double(in->par.RR_T3plus);
     }
     else
       mort_hr = in->hr_metastatic(age_diag);
@@ -375,16 +2245,16 @@ namespace fhcrc_example {
     double age_d = -1.0;        // age at death (output)
     double age_m = tm + 35.0;   // age at onset of metastatic cancer
     bool localised = (age_diag < age_m);
-    double txhaz = (localised && (tx == RP || tx == RT)) ? in->parameter["RP_mortHR"] : 1.0; // assume same HR for RP & RT
+    double txhaz = (localised && (tx == RP || tx == RT)) ? in->par.RP_mortHR : 1.0; // assume same HR for RP & RT
     // calibration HR(age_diag,PSA,ext_grade) for loco-regional or HR(age_diag) for metastatic cancer
     double lead_time = age_c - age_diag;
-    double txbenefit = exp(log(txhaz)+log(double(in->parameter["c_txlt_interaction"]))*lead_time); // treatment lead-time interaction
+    double txbenefit = exp(log(txhaz)+log(double(in->par.c_txlt_interaction))*lead_time); // treatment lead-time interaction
     double mort_hr = calculate_mortality_hr(age_diag);
-    double ustar = pow(u,1/(in->parameter["c_baseline_specific"]*mort_hr*txbenefit*in->parameter["sxbenefit"]));
+    double ustar = pow(u,1/(in->par.c_baseline_specific*mort_hr*txbenefit*in->par.sxbenefit));
     if (localised)
-      age_d = age_c + in->H_local[H_local_t::key_type(* in->H_local_age_set.lower_bound(bounds<double>(age_diag,50.0,80.0)),grade)].invert(-log(ustar));
+      age_d = age_c + in->H_local.invert(bounds<double>(age_diag,50.0,80.0),grade,-log(ustar));
     else
-      age_d = age_c + in->H_dist[grade].invert(-log(ustar));
+      age_d = age_c + in->H_dist.invert(0.0,grade,-log(ustar));
     if (in->debug) Rprintf("id=%i, lead_time=%f, ext_grade=%i, psamean=%f, tx=%i, txbenefit=%f, u=%f, ustar=%f, age_diag=%f, age_m=%f, age_c=%f, age_d=%f, mort_hr=%f\n",
 		       id, lead_time, (int)ext_grade, psamean(age_diag), (int)tx, txbenefit, u, ustar, age_diag, age_m, age_c, age_d, mort_hr);
     return age_d;
@@ -402,31 +2272,25 @@ namespace fhcrc_example {
   }
 
   void FhcrcPerson::opportunistic_rescreening(double psa) {
-    double prescreened = 1.0 - in->rescreen_cure(bounds<double>(now(),30.0,90.0),psa);
-    double shape = in->rescreen_shape(bounds<double>(now(),30.0,90.0),psa);
-    double scale = in->rescreen_scale(bounds<double>(now(),30.0,90.0),psa);
-    double u = R::runif(0.0,1.0);
-    double t = now() + R::rweibull(shape,scale);
+    const double* rescreen = in->rescreen(bounds<double>(now(),30.0,90.0),psa);
+    double prescreened = 1.0 - rescreen[RescreenCure];
+    double shape = rescreen[RescreenShape];
+    double scale = rescreen[RescreenScale];
+    double u = rng->runif(0.0,1.0);
+    double t = now() + rng->rweibull(shape,scale);
     if (u<prescreened) {
       scheduleAt(t, toScreen);
     }
   }
 
   void FhcrcPerson::cancel_events_after_diagnosis() {
-    RemoveKind(toLocalised);
-    RemoveKind(toMetastatic);
-    RemoveKind(toT3plus);
-    RemoveKind(toScreen);
-    RemoveKind(toOrganised);
-    RemoveKind(toBiopsyFollowUpScreen);
-    RemoveKind(toScreenInitiatedBiopsy);
-    RemoveKind(toSTHLM3);
-    RemoveKind(toOpportunistic);
-    RemoveKind(toCancelScreens);
-    RemoveKind(toScreenDiagnosis);
-    RemoveKind(toOverDiagnosis);
-    RemoveKind(toClinicalDiagnosis);
-    RemoveKind(toClinicalDiagnosticBiopsy);
+    static const unsigned long kinds =
+      kind_bit(toLocalised) | kind_bit(toMetastatic) | kind_bit(toT3plus) |
+      kind_bit(toScreen) | kind_bit(toOrganised) | kind_bit(toBiopsyFollowUpScreen) |
+      kind_bit(toScreenInitiatedBiopsy) | kind_bit(toSTHLM3) | kind_bit(toOpportunistic) |
+      kind_bit(toCancelScreens) | kind_bit(toScreenDiagnosis) | kind_bit(toOverDiagnosis) |
+      kind_bit(toClinicalDiagnosis) | kind_bit(toClinicalDiagnosticBiopsy);
+    RemoveKinds(kinds);
   }
 
   void FhcrcPerson::opportunistic_uptake_if_ever() {
@@ -435,47 +2299,47 @@ namespace fhcrc_example {
     // (ii)  cohorts aged 50+ in 1995 have a llogis(2,10) distribution from 1995 (cohort < 1945)
     // (iii) intermediate cohorts are a weighted mixture of (i) and (ii)
     double first_screen;
-    if (cohort > double(in->parameter["endUptakeMixture"])) {
-      first_screen = 35.0 + R::rllogis(in->parameter["shapeA"],
-				       in->parameter["scaleA"]); // (i) age
-    } else if (cohort < double(in->parameter["startUptakeMixture"])) {
-      first_screen = (double(in->parameter["screeningIntroduced"]) - cohort) +
-	R::rllogis(in->parameter["shapeT"],in->parameter["scaleT"]); // (ii) period
+    if (cohort > double(in->par.endUptakeMixture)) {
+      first_screen = 35.0 + rng->rllogis(in->par.shapeA,
+				       in->par.scaleA); // (i) age
+    } else if (cohort < double(in->par.startUptakeMixture)) {
+      first_screen = (in->par.screeningIntroduced - cohort) +
+	rng->rllogis(in->par.shapeT,in->par.scaleT); // (ii) period
     } else {
-      double age0 = double(in->parameter["screeningIntroduced"]) - cohort;
-      double u = R::runif(0.0,1.0);
-      if ((age0 - 35.0) / (double(in->parameter["endUptakeMixture"]) -
-			   double(in->parameter["startUptakeMixture"])) < u) // (iii) mixture
-	first_screen = age0 + R::rllogis_trunc(in->parameter["shapeA"],
-					       in->parameter["scaleA"],
+      double age0 = in->par.screeningIntroduced - cohort;
+      double u = rng->runif(0.0,1.0);
+      if ((age0 - 35.0) / (double(in->par.endUptakeMixture) -
+			   double(in->par.startUptakeMixture)) < u) // (iii) mixture
+	first_screen = age0 + rng->rllogis_trunc(in->par.shapeA,
+					       in->par.scaleA,
 					       age0-35.0);
-      else first_screen = age0 + R::rllogis(in->parameter["shapeT"],
-					    in->parameter["scaleT"]);
+      else first_screen = age0 + rng->rllogis(in->par.shapeT,
+					    in->par.scaleT);
     }
     scheduleAt(first_screen, toScreen);
   }
 
   bool FhcrcPerson::screening_preference() {
-    double pscreening = double(cohort>=in->parameter["startFullUptake"]) ?
-      double(in->parameter["fullUptakePortion"]) : (double(in->parameter["fullUptakePortion"])
-      - (double(in->parameter["startUptakeMixture"]) - cohort) * double(in->parameter["yearlyUptakeIncrease"]));
+    double pscreening = double(cohort>=in->par.startFullUptake) ?
+      double(in->par.fullUptakePortion) : (double(in->par.fullUptakePortion)
+      - (double(in->par.startUptakeMixture) - cohort) * double(in->par.yearlyUptakeIncrease));
     // decrease for previous year instead of increase for next year
-    double uscreening = R::runif(0.0,1.0);
+    double uscreening = rng->runif(0.0,1.0);
     return (uscreening<pscreening);
   }
 
   void FhcrcPerson::rescreening_schedules(double psa, bool organised, bool mixed_programs) {
     // Check for organised screens - opportunistic screens are described later
-    if (R::runif(0.0,1.0) < in->parameter["rescreeningParticipation"]) {
-      switch (in->screen) {
+    if (rng->runif(0.0,1.0) < in->par.rescreeningParticipation) {
+      switch (screen) {
       case mixed_screening:
       case stockholm3_goteborg:
       case goteborg:
         {
-          if (organised && now() >= in->parameter["start_screening"] && now() < in->parameter["stop_screening"]) { // age groups
-            if (psa<1.0 && now()+4.0 <= in->parameter["stop_screening"]) // re-screen late for low psa
+          if (organised && now() >= in->par.start_screening && now() < in->par.stop_screening) { // age groups
+            if (psa<1.0 && now()+4.0 <= in->par.stop_screening) // re-screen late for low psa
               scheduleAt(now() + 4.0, toScreen);
-            else if (psa>=1.0 && now()+2.0 <= in->parameter["stop_screening"]) // re-screen soon for moderate psa
+            else if (psa>=1.0 && now()+2.0 <= in->par.stop_screening) // re-screen soon for moderate psa
               scheduleAt(now() + 2.0, toScreen);
             // else do nothing
           }
@@ -484,23 +2348,23 @@ namespace fhcrc_example {
       case introduced_screening: //rescreen
       case introduced_screening_preference:
       case introduced_screening_only:
-        if (organised && now() + in->parameter["screening_interval"] <= in->parameter["stop_screening"]) {// within age?
-          scheduleAt(now() + in->parameter["screening_interval"], toOrganised); //if there are planned opportunistic screens
+        if (organised && now() + in->par.screening_interval <= in->par.stop_screening) {// within age?
+          scheduleAt(now() + in->par.screening_interval, toOrganised); //if there are planned opportunistic screens
         }
         break;
       case stockholm3_risk_stratified:
       case risk_stratified:
-        if (now() >= in->parameter["start_screening"]) {
-          if (psa<1.0 && now()+8.0 <= in->parameter["stop_screening"])
+        if (now() >= in->par.start_screening) {
+          if (psa<1.0 && now()+8.0 <= in->par.stop_screening)
             scheduleAt(now() + 8.0, toScreen);
-          if (psa>=1.0 && now()+4.0 <= in->parameter["stop_screening"])
+          if (psa>=1.0 && now()+4.0 <= in->par.stop_screening)
             scheduleAt(now() + 4.0, toScreen);
         }
         break;
       case regular_screen:
-        if (in->parameter["start_screening"] <= now() &&
-            now() + in->parameter["screening_interval"] <= in->parameter["stop_screening"])
-          scheduleAt(now() + in->parameter["screening_interval"], toScreen);
+        if (in->par.start_screening <= now() &&
+            now() + in->par.screening_interval <= in->par.stop_screening)
+          scheduleAt(now() + in->par.screening_interval, toScreen);
         break;
       case twoYearlyScreen50to70:
         if (50.0 <= now() && now() < 70.0)
@@ -516,14 +2380,14 @@ namespace fhcrc_example {
       case screen50:
       case screen60:
       case screen70:
+      case noScreening:
       case stopped_screening:
         break;
-      default:
-        REprintf("Screening not matched: %s\n",in->screen);
+      default: // not reached: callFhcrc() checks the scenario
         break;
       }
     } // rescreening participation
-    if (in->screen == screenUptake || (mixed_programs && !organised))
+    if (screen == screenUptake || (mixed_programs && !organised))
       opportunistic_rescreening(psa); // includes rescreening participation
   } // rescreening
 
@@ -532,7 +2396,7 @@ namespace fhcrc_example {
         (state == Localised && ext_state == ext::T3plus) ||
         (state == Localised && ext_state == ext::T1_T2 &&
          (now > t3p + 35.0 - (t3p - t0) *
-          in->parameter["biopsySensitivityTimeProportionT1T2"] *
+          in->par.biopsySensitivityTimeProportionT1T2 *
           in->tableBiopsySensitivity(bounds(year,1987.0,2000.0)) /
           in->tableBiopsySensitivity(2000.0))));
   }
@@ -567,69 +2431,101 @@ namespace fhcrc_example {
 /**
     Initialise a simulation run for an individual
  */
-void FhcrcPerson::init() {
-
-  // declarations
-  double ym;
-
-  // utilities
-  utilities->clear();
-
-  // change state variables
-  state = Healthy;
-  ext_state = ext::Healthy_state;
-  grade = base::Healthy;
-  ext_grade = ext::Healthy;
-  dx = NotDiagnosed;
-  everPSA = previousNegativeBiopsy = organised = adt = false;
-  in->rngNh->set();
-  if (R::runif(0.0, 1.0) <= in->parameter["susceptible"]) // portion susceptible
-    t0 = sqrt(2*R::rexp(1.0)/in->parameter["g0"]); // is susceptible
+/**
+    Draw the natural history from the NhStream
+*/
+void FhcrcPerson::sampleNaturalHistory() {
+  rng->set(NhStream);
+  if (rng->runif(0.0, 1.0) <= in->par.susceptible) // portion susceptible
+    t0 = sqrt(2*rng->rexp(1.0)/in->par.g0); // is susceptible
   else
     t0 = 200.0; // not susceptible
-  if (!in->bparameter["revised_natural_history"]){
-    future_grade = (R::runif(0.0, 1.0)>=1+in->parameter["c_low_grade_slope"]*t0) ? base::Gleason_ge_8 : base::Gleason_le_7;
-    beta2 = R::rnormPos(in->mubeta2[future_grade],in->sebeta2[future_grade]);
+  if (!in->par.revised_natural_history){
+    future_grade = (rng->runif(0.0, 1.0)>=1+in->par.c_low_grade_slope*t0) ? base::Gleason_ge_8 : base::Gleason_le_7;
+    beta2 = rng->rnormPos(in->mubeta2[future_grade],in->sebeta2[future_grade]);
   }
   else {
     // multinomial logistic regression
-    double u = R::runif(0.0,1.0);
+    double u = rng->runif(0.0,1.0);
     double denom = 1.0 +
-      exp(in->parameter["alpha7"] + in->parameter["beta7"] * t0) +
-      exp(in->parameter["alpha8"] + in->parameter["beta8"] * t0);
+      exp(in->par.alpha7 + in->par.beta7 * t0) +
+      exp(in->par.alpha8 + in->par.beta8 * t0);
     double p6 = 1.0/denom;
-    double p7 = exp(in->parameter["alpha7"] + in->parameter["beta7"] * t0) / denom;
-    // double p8 = exp(in->parameter["alpha8"] + in->parameter["beta8"] * t0) / denom;
+    double p7 = exp(in->par.alpha7 + in->par.beta7 * t0) / denom;
+    // double p8 = exp(in->par.alpha8 + in->par.beta8 * t0) / denom;
     if (u < p6) future_ext_grade = ext::Gleason_le_6;
     else if (u < p6+p7) future_ext_grade = ext::Gleason_7;
     else future_ext_grade = ext::Gleason_ge_8;
     future_grade = future_ext_grade == ext::Gleason_ge_8 ? base::Gleason_ge_8 : base::Gleason_le_7;
-    beta2 = R::rnormPos(in->mubeta2[future_ext_grade],in->sebeta2[future_ext_grade]);
+    beta2 = rng->rnormPos(in->mubeta2[future_ext_grade],in->sebeta2[future_ext_grade]);
   }
-  beta0 = R::rnorm(in->parameter["mubeta0"],in->parameter["sebeta0"]);
-  beta1 = R::rnormPos(in->parameter["mubeta1"],in->parameter["sebeta1"]);
+  beta0 = rng->rnorm(in->par.mubeta0,in->par.sebeta0);
+  beta1 = rng->rnormPos(in->par.mubeta1,in->par.sebeta1);
 
   y0 = psamean(t0+35); // depends on: t0, beta0, beta1, beta2
-  t3p = calculate_transition_time(R::runif(0.0,1.0), t0, in->parameter["g3p"]);
-  tm = calculate_transition_time(R::runif(0.0,1.0), t3p, in->parameter["gm"]);
-  ym = psamean(tm+35);
+  t3p = calculate_transition_time(rng->runif(0.0,1.0), t0, in->par.g3p);
+  tm = calculate_transition_time(rng->runif(0.0,1.0), t3p, in->par.gm);
   if (future_grade==base::Gleason_le_7) { // Annals
-    tc = calculate_transition_time(R::runif(0.0,1.0), t0, in->parameter["gc"]);
-    tmc = calculate_transition_time(R::runif(0.0,1.0), tm, in->parameter["gc"]*in->parameter["thetac"]);
+    tc = calculate_transition_time(rng->runif(0.0,1.0), t0, in->par.gc);
+    tmc = calculate_transition_time(rng->runif(0.0,1.0), tm, in->par.gc*in->par.thetac);
   } else {
-    tc = calculate_transition_time(R::runif(0.0,1.0), t0, in->parameter["gc"]*in->parameter["grade.clinical.rate.high"]);
-    tmc = calculate_transition_time(R::runif(0.0,1.0), tm, in->parameter["gc"]*in->parameter["thetac"]*in->parameter["grade.clinical.rate.high"]);
+    tc = calculate_transition_time(rng->runif(0.0,1.0), t0, in->par.gc*in->par.grade_clinical_rate_high);
+    tmc = calculate_transition_time(rng->runif(0.0,1.0), tm, in->par.gc*in->par.thetac*in->par.grade_clinical_rate_high);
   }
-  out->tmc_minus_t0 += (tmc - t0);
-  aoc = in->rmu0.rand(R::runif(0.0,1.0));
-  if (!in->bparameter["revised_natural_history"]){
+  aoc = in->rmu0.rand(rng->runif(0.0,1.0));
+  if (!in->par.revised_natural_history){
     future_ext_grade= (future_grade==base::Gleason_le_7) ?
-      (R::runif(0.0,1.0) <= in->interp_prob_grade7.approx(beta2) ? ext::Gleason_7 : ext::Gleason_le_6) :
+      (rng->runif(0.0,1.0) <= in->interp_prob_grade7.approx(beta2) ? ext::Gleason_7 : ext::Gleason_le_6) :
       ext::Gleason_ge_8;
   }
+}
+
+NaturalHistory FhcrcPerson::naturalHistory() const {
+  NaturalHistory nh;
+  nh.t0 = t0; nh.beta0 = beta0; nh.beta1 = beta1; nh.beta2 = beta2;
+  nh.y0 = y0; nh.t3p = t3p; nh.tm = tm; nh.tc = tc; nh.tmc = tmc; nh.aoc = aoc;
+  nh.future_grade = future_grade;
+  nh.future_ext_grade = future_ext_grade;
+  nh.nhStream = rng->state(NhStream);
+  return nh;
+}
+
+/**
+    Use a natural history drawn in advance, leaving the NhStream as if
+    it had been drawn here
+*/
+void FhcrcPerson::setNaturalHistory(const NaturalHistory& nh) {
+  t0 = nh.t0; beta0 = nh.beta0; beta1 = nh.beta1; beta2 = nh.beta2;
+  y0 = nh.y0; t3p = nh.t3p; tm = nh.tm; tc = nh.tc; tmc = nh.tmc; aoc = nh.aoc;
+  future_grade = nh.future_grade;
+  future_ext_grade = nh.future_ext_grade;
+  rng->restore(NhStream, nh.nhStream);
+}
+
+void FhcrcPerson::init() {
+
+  // declarations
+  double ym;
+
+  // utilities
+  utilities->clear();
+
+  // change state variables
+  state = Healthy;
+  ext_state = ext::Healthy_state;
+  grade = base::Healthy;
+  ext_grade = ext::Healthy;
+  dx = NotDiagnosed;
+  everPSA = previousNegativeBiopsy = organised = adt = false;
+  if (natural)
+    setNaturalHistory(*natural);
+  else
+    sampleNaturalHistory();
+  ym = psamean(tm+35);
+  out->tmc_minus_t0 += (tmc - t0);
 
   if (in->debug) {
-    Rprintf("id=%i, future_grade=%i, future_ext_grade=%i, beta0=%f, beta1=%f, beta2=%f, mubeta0=%f, sebeta0=%f, mubeta1=%f, sebeta1=%f, mubeta2=%f, sebeta2=%f\n", id, future_grade, future_ext_grade, beta0, beta1, beta2, double(in->parameter["mubeta0"]), double(in->parameter["sebeta0"]), double(in->parameter["mubeta1"]), double(in->parameter["sebeta1"]), in->mubeta2[future_grade], in->sebeta2[future_grade]);
+    Rprintf("id=%i, future_grade=%i, future_ext_grade=%i, beta0=%f, beta1=%f, beta2=%f, mubeta0=%f, sebeta0=%f, mubeta1=%f, sebeta1=%f, mubeta2=%f, sebeta2=%f\n", id, future_grade, future_ext_grade, beta0, beta1, beta2, double(in->par.mubeta0), double(in->par.sebeta0), double(in->par.mubeta1), double(in->par.sebeta1), in->mubeta2[future_grade], in->sebeta2[future_grade]);
   }
 
   tx = no_treatment;
@@ -639,12 +2535,12 @@ void FhcrcPerson::init() {
   scheduleAt(aoc,toOtherDeath);
 
   // schedule screening events that depend on screeningParticipation
-  in->rngScreen->set();
-  rescreening_frailty = R::rgamma(1.25, 1.25);
-  double u1 = R::runif(0.0,1.0);
-  double u2 = R::runif(0.0,1.0);
-  if (R::runif(0.0,1.0)<in->parameter["screeningParticipation"]) {
-    switch(in->screen) {
+  rng->set(ScreenStream);
+  rescreening_frailty = rng->rgamma(1.25, 1.25);
+  double u1 = rng->runif(0.0,1.0);
+  double u2 = rng->runif(0.0,1.0);
+  if (rng->runif(0.0,1.0)<in->par.screeningParticipation) {
+    switch(screen) {
     case noScreening:
       break; // no screening
     case randomScreen50to70:
@@ -654,7 +2550,7 @@ void FhcrcPerson::init() {
     case regular_screen:
     case goteborg:
     case risk_stratified:
-      scheduleAt(in->parameter["start_screening"],toScreen);
+      scheduleAt(in->par.start_screening,toScreen);
       break;
     case fourYearlyScreen50to70: // 50,54,58,62,66,70
     case twoYearlyScreen50to70:  // 50,52, ..., 68,70
@@ -677,62 +2573,61 @@ void FhcrcPerson::init() {
     case screenUptake:
       // see below (models screening participation)
       break;
-    default:
-      REprintf("Screening not matched: %i\n",in->screen);
+    default: // not reached: callFhcrc() checks the scenario
       break;
     }
   }
 
   // schedule screening events that already incorporate screening participation
-  switch(in->screen) {
+  switch(screen) {
   case mixed_screening:
     if (screening_preference())
       opportunistic_uptake_if_ever();
-    scheduleAt(in->parameter["start_screening"], toOrganised);
+    scheduleAt(in->par.start_screening, toOrganised);
     break;
   case stopped_screening:
     if (screening_preference())
       opportunistic_uptake_if_ever();
-    scheduleAt(in->parameter["introduction_year"] - cohort, toCancelScreens);
+    scheduleAt(in->par.introduction_year - cohort, toCancelScreens);
     break;
   case introduced_screening: //first screen
     // One participation during opportunistic and another during the regular screening
     if (screening_preference())
       opportunistic_uptake_if_ever(); // 'toOrganised' will remove opportunistic screens
-    if ( in->parameter["introduction_year"] - cohort <= in->parameter["start_screening"]) { // under screen age at 2015
-      scheduleAt(in->parameter["start_screening"], toOrganised); //screen all in age interval
-    } else if( in->parameter["introduction_year"] - cohort >= in->parameter["start_screening"] && //between screen ages
-               in->parameter["introduction_year"] - cohort <= in->parameter["stop_screening"]) {
-      scheduleAt(u1 + in->parameter["introduction_year"] - cohort, toOrganised); //in 1 year screen all in age interval
+    if ( in->par.introduction_year - cohort <= in->par.start_screening) { // under screen age at 2015
+      scheduleAt(in->par.start_screening, toOrganised); //screen all in age interval
+    } else if( in->par.introduction_year - cohort >= in->par.start_screening && //between screen ages
+               in->par.introduction_year - cohort <= in->par.stop_screening) {
+      scheduleAt(u1 + in->par.introduction_year - cohort, toOrganised); //in 1 year screen all in age interval
     }
     break;
   case introduced_screening_preference: //first screen
     // Only those who would have had a opportunistic screen will have a regular screen
     if (screening_preference()) {
       opportunistic_uptake_if_ever(); // 'toOrganised' will remove opportunistic screens
-      if ( in->parameter["introduction_year"] - cohort <= in->parameter["start_screening"]) { // under screen age at 2015
-	scheduleAt(in->parameter["start_screening"], toOrganised); //screen all in age interval
-      } else if( in->parameter["introduction_year"] - cohort >= in->parameter["start_screening"] && //between screen ages
-		 in->parameter["introduction_year"] - cohort <= in->parameter["stop_screening"]) {
-	scheduleAt(u1 + in->parameter["introduction_year"] - cohort, toOrganised); //in 1 year screen all in age interval
+      if ( in->par.introduction_year - cohort <= in->par.start_screening) { // under screen age at 2015
+	scheduleAt(in->par.start_screening, toOrganised); //screen all in age interval
+      } else if( in->par.introduction_year - cohort >= in->par.start_screening && //between screen ages
+		 in->par.introduction_year - cohort <= in->par.stop_screening) {
+	scheduleAt(u1 + in->par.introduction_year - cohort, toOrganised); //in 1 year screen all in age interval
       }
     }
     break;
   case introduced_screening_only: //first screen
-    if ( in->parameter["introduction_year"] - cohort <= in->parameter["start_screening"]) {
-      scheduleAt(in->parameter["start_screening"], toOrganised); //screen all in age interval
-    } else if( in->parameter["introduction_year"] - cohort >= in->parameter["start_screening"] && //between screen ages
-	       in->parameter["introduction_year"] - cohort <= in->parameter["stop_screening"]) {
-      scheduleAt(u1 + in->parameter["introduction_year"] - cohort, toOrganised); //in 1 year screen all in age interval
+    if ( in->par.introduction_year - cohort <= in->par.start_screening) {
+      scheduleAt(in->par.start_screening, toOrganised); //screen all in age interval
+    } else if( in->par.introduction_year - cohort >= in->par.start_screening && //between screen ages
+	       in->par.introduction_year - cohort <= in->par.stop_screening) {
+      scheduleAt(u1 + in->par.introduction_year - cohort, toOrganised); //in 1 year screen all in age interval
     }
     break;
   case stockholm3_goteborg:
   case stockholm3_risk_stratified:
     if (screening_preference())
       opportunistic_uptake_if_ever();
-    if (u1 < in->parameter["studyParticipation"] &&
-	(2013.0-cohort >= in->parameter["start_screening"] &&
-	 2013.0-cohort < in->parameter["stop_screening"]))
+    if (u1 < in->par.studyParticipation &&
+	(2013.0-cohort >= in->par.start_screening &&
+	 2013.0-cohort < in->par.stop_screening))
       scheduleAt((u2 * 2.0 + 2013.0) - cohort, toSTHLM3);
     break;
   case screenUptake:
@@ -743,7 +2638,7 @@ void FhcrcPerson::init() {
     break;
   }
 
-  in->rngNh->set();
+  rng->set(NhStream);
 
   // utilities
   // | LowerAge | UpperAge | Males | Females |
@@ -775,49 +2670,91 @@ void FhcrcPerson::init() {
   // 	 (append (list 0 18) (loop for i from 25 to 80 by 5 collect i))))
   //  (loop for utility in utilities for age in ages
   //   do (message (format "scheduleUtilityChange(%g.0, 5.0, %g);" age utility))))
-  scheduleUtilityChange(0.0, 18.0, 1.00);
-  scheduleUtilityChange(18.0, 25.0, 0.89);
-  scheduleUtilityChange(25.0, 30.0, 0.89);
-  scheduleUtilityChange(30.0, 35.0, 0.88);
-  scheduleUtilityChange(35.0, 40.0, 0.87);
-  scheduleUtilityChange(40.0, 45.0, 0.84);
-  scheduleUtilityChange(45.0, 50.0, 0.84);
-  scheduleUtilityChange(50.0, 55.0, 0.83);
-  scheduleUtilityChange(55.0, 60.0, 0.83);
-  scheduleUtilityChange(60.0, 65.0, 0.82);
-  scheduleUtilityChange(65.0, 70.0, 0.83);
-  scheduleUtilityChange(70.0, 75.0, 0.81);
-  scheduleUtilityChange(75.0, 80.0, 0.79);
-  scheduleUtilityChange(80.0, 1.0e99, 0.74);
+  // Values in BackgroundUtility; with utility_background_analytic, these
+  // are evaluated in Utilities::utility() rather than scheduled.
+  if (!utilities->background) {
+    for (int i = 0; i < BackgroundUtility::N; ++i)
+      scheduleUtilityChange(BackgroundUtility::ages[i],
+			    i+1 < BackgroundUtility::N ? BackgroundUtility::ages[i+1] : 1.0e99,
+			    BackgroundUtility::values[i]);
+  }
 
   // record some parameters using SimpleReport - too many for a tuple
   if (id < in->nLifeHistories) {
-    out->outParameters.record("id",double(id));
-    out->outParameters.record("beta0",beta0);
-    out->outParameters.record("beta1",beta1);
-    out->outParameters.record("beta2",beta2);
-    out->outParameters.record("t0",t0);
-    out->outParameters.record("tm",tm);
-    out->outParameters.record("tc",tc);
-    out->outParameters.record("tmc",tmc);
-    out->outParameters.record("y0",y0);
-    out->outParameters.record("ym",ym);
-    out->outParameters.record("aoc",aoc);
-    out->outParameters.record("cohort",cohort);
-    out->outParameters.record("future_ext_grade",future_ext_grade);
-    out->outParameters.record("ext_grade",ext_grade);
-    out->outParameters.record("age_psa",-1.0);
-    out->outParameters.record("age_pca",-1.0);
-    out->outParameters.record("pca_death",0.0);
-    out->outParameters.record("psa55",psameasured(55.0));
-    out->outParameters.record("psa65",psameasured(65.0));
-    out->outParameters.record("psa75",psameasured(75.0));
-    out->outParameters.record("psa85",psameasured(85.0));
-    out->outParameters.record("rescreening_frailty",rescreening_frailty);
-  }
-
-  if (in->debug) Rprint_actions();
+    double* r = out->outParameters.add();
+    r[ParameterRecord::id] = double(id);
+    r[ParameterRecord::beta0] = beta0;
+    r[ParameterRecord::beta1] = beta1;
+    r[ParameterRecord::beta2] = beta2;
+    r[ParameterRecord::t0] = t0;
+    r[ParameterRecord::tm] = tm;
+    r[ParameterRecord::tc] = tc;
+    r[ParameterRecord::tmc] = tmc;
+    r[ParameterRecord::y0] = y0;
+    r[ParameterRecord::ym] = ym;
+    r[ParameterRecord::aoc] = aoc;
+    r[ParameterRecord::cohort] = cohort;
+    r[ParameterRecord::future_ext_grade] = future_ext_grade;
+    r[ParameterRecord::ext_grade] = ext_grade;
+    r[ParameterRecord::age_psa] = -1.0;
+    r[ParameterRecord::age_pca] = -1.0;
+    r[ParameterRecord::pca_death] = 0.0;
+    r[ParameterRecord::psa55] = psameasured(55.0);
+    r[ParameterRecord::psa65] = psameasured(65.0);
+    r[ParameterRecord::psa75] = psameasured(75.0);
+    r[ParameterRecord::psa85] = psameasured(85.0);
+    r[ParameterRecord::rescreening_frailty] = rescreening_frailty;
+  }
+
+  if (in->debug) queue->Rprint_actions();
+
+}
+
+/**
+    Analytic fast path for a man for whom healthyLife_p() holds: report
+    the same periods as init() and handleMessage(toOtherDeath) would,
+    without the event queue. The natural history (and hence his random
+    numbers) is drawn as for the other men.
+*/
+void FhcrcPerson::healthyLife() {
+  utilities->clear();
+  state = Healthy;
+  ext_state = ext::Healthy_state;
+  grade = base::Healthy;
+  ext_grade = ext::Healthy;
+  dx = NotDiagnosed;
+  everPSA = previousNegativeBiopsy = organised = adt = false;
+  tx = no_treatment;
+  txhaz = -1.0;
+  setNaturalHistory(*natural);
+  out->tmc_minus_t0 += (tmc - t0);
+
+  // as for handleMessage(toOtherDeath) at age aoc
+  rng->set(NhStream);
+  double psa = in->par.lazy_psa ? psamean(aoc) : psameasured(aoc);
+  previousEventTime = 0.0;
+  for (double change = BackgroundUtility::next_change(previousEventTime);
+       change < aoc;
+       change = BackgroundUtility::next_change(change)) {
+    record(toUtilityChange, previousEventTime, change, psa, utility());
+    previousEventTime = change;
+  }
+  record(toOtherDeath, previousEventTime, aoc, psa, utility());
+  previousEventTime = aoc;
+}
 
+/**
+    Record the period from lhs to rhs that ends with an event of a given kind
+ */
+void FhcrcPerson::record(short kind, double lhs, double rhs, double psa, double utility) {
+  if (in->par.full_report)
+    out->report.add(in->fullStates.code(ext_state, ext_grade, dx, psa>=3.0, cohort), kind, lhs, rhs, utility);
+  out->shortReport.add(1, kind, lhs, rhs, utility);
+  out->outcome[Outcome::qalys] += out->shortReport.discountedInterval(lhs, rhs, utility);
+
+  if (id < in->nLifeHistories) { // only record up to the first n individuals
+    out->addLifeHistory(LifeHistory::Type(id, ext_state, ext_grade, dx, kind, lhs, rhs, rhs + cohort, psa, utility));
+  }
 }
 
 /**
@@ -826,35 +2763,45 @@ void FhcrcPerson::init() {
 void FhcrcPerson::handleMessage(const cMessage* msg) {
 
   // by default, use the natural history RNG
-  in->rngNh->set();
+  rng->set(NhStream);
+
+  // With lazy_psa, only draw the PSA measurement (and detectability)
+  // for the events that use them; otherwise report the mean PSA.
+  bool measure = !in->par.lazy_psa ||
+    msg->kind == toScreen || msg->kind == toBiopsyFollowUpScreen ||
+    msg->kind == toScreenInitiatedBiopsy;
 
   // declarations
-  double psa = psameasured(now()); // includes measurement error
-  // double test = panel ? biomarker : psa;
   double Z = psamean(now());
+  double psa = measure ? psameasured(now()) : Z; // includes measurement error
+  // double test = panel ? biomarker : psa;
   double age = now();
   double year = age + cohort;
   double compliance;
-  bool mixed_programs = (in->screen == mixed_screening) ||
-    (in->screen == introduced_screening) ||
-    (in->screen == introduced_screening_preference) ||
-    (in->screen == stopped_screening);
-  bool formal_costs = in->parameter["formal_costs"]==1.0 && (!mixed_programs || organised);
-  bool formal_compliance = in->parameter["formal_compliance"]==1.0 && (!mixed_programs || organised);
-  double utility = FhcrcPerson::utility();
-  bool detectable = FhcrcPerson::detectable(now(), year);
-  if (in->parameter["rand_biopsy_sensitivityG6"]<1.0) {
-    detectable = detectable && R::runif(0.0,1.0) < in->parameter["rand_biopsy_sensitivityG6"];
+  bool mixed_programs = policy->mixed_programs;
+  bool formal_costs = policy->formal_costs && (!mixed_programs || organised);
+  bool formal_compliance = policy->formal_compliance && (!mixed_programs || organised);
+  bool detectable = false;
+  if (measure) {
+    detectable = FhcrcPerson::detectable(now(), year);
+    if (in->par.rand_biopsy_sensitivityG6<1.0) {
+      detectable = detectable && rng->runif(0.0,1.0) < in->par.rand_biopsy_sensitivityG6;
+    }
   }
 
   // record information
-  if (in->parameter["full_report"] == 1.0)
-    out->report.add(FullState::Type(ext_state, ext_grade, dx, psa>=3.0, cohort), msg->kind, previousEventTime, age, utility);
-  out->shortReport.add(1, msg->kind, previousEventTime, age, utility);
-
-  if (id < in->nLifeHistories) { // only record up to the first n individuals
-    out->lifeHistories.push_back(LifeHistory::Type(id, ext_state, ext_grade, dx, msg->kind, previousEventTime, age, year, psa, utility));
+  if (utilities->background) {
+    // report the changes in the background utility since the last event
+    // as toUtilityChange events
+    for (double change = BackgroundUtility::next_change(previousEventTime);
+	 change < age;
+	 change = BackgroundUtility::next_change(change)) {
+      record(toUtilityChange, previousEventTime, change, psa, utility());
+      previousEventTime = change;
+    }
   }
+  double utility = FhcrcPerson::utility();
+  record(msg->kind, previousEventTime, age, psa, utility);
 
   if (in->debug)
     Rprint(*utilities);
@@ -864,22 +2811,23 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
   switch(msg->kind) {
 
   case toCancerDeath:
-    lost_productivity("Terminal illness");
-    add_costs("Cancer death");
+    lost_productivity(Category::TerminalIllness);
+    add_costs(Category::CancerDeath);
+    out->outcome[Outcome::pca_deaths] += 1000.0;
     if (id < in->nLifeHistories) {
-      out->outParameters.record("age_d",now());
-      out->outParameters.revise("pca_death",1.0);
+      out->outParameters.last()[ParameterRecord::age_d] = now();
+      out->outParameters.last()[ParameterRecord::pca_death] = 1.0;
     }
-    Sim::stop_simulation();
+    queue->stop_simulation();
     break;
 
   case toOtherDeath:
-    // add_costs("Death"); // cost for death, should this be zero???
+    // add_costs(Category::Death); // cost for death, should this be zero???
 
     if (id < in->nLifeHistories) {
-      out->outParameters.record("age_d",now());
+      out->outParameters.last()[ParameterRecord::age_d] = now();
     }
-    Sim::stop_simulation();
+    queue->stop_simulation();
     break;
 
   case toLocalised:
@@ -901,16 +2849,14 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
 
   case toMetastatic:
     state = Metastatic; ext_state = ext::Metastatic;
-    RemoveKind(toClinicalDiagnosis);
-    RemoveKind(toClinicalDiagnosticBiopsy);
+    RemoveKinds(kind_bit(toClinicalDiagnosis) | kind_bit(toClinicalDiagnosticBiopsy));
     if (now()<tc+35.0-6.0/52.0)
       scheduleAt(tmc+35.0-6.0/52.0,toClinicalDiagnosticBiopsy);
     if (now()<tc+35.0-3.0/52.0)
       scheduleAt(tmc+35.0-3.0/52.0,toClinicalDiagnosticBiopsy);
     scheduleAt(tmc+35.0,toClinicalDiagnosis);
     // Remove possible secondary Tx
-    RemoveKind(toRP);
-    RemoveKind(toRT);
+    RemoveKinds(kind_bit(toRP) | kind_bit(toRT));
     break;
 
   case toOrganised:
@@ -927,105 +2873,105 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
 
   case toScreen:
   case toBiopsyFollowUpScreen: {
-    in->rngScreen->set();
+    rng->set(ScreenStream);
     this->psa_last_screen = psa;
-    if (in->bparameter["includePSArecords"]) {
-      out->psarecord.record("id",id);
-      out->psarecord.record("state",state);
-      out->psarecord.record("ext_grade",ext_grade);
-      out->psarecord.record("organised",organised); // only meaningful for mixed_programs
-      out->psarecord.record("dx",dx);
-      out->psarecord.record("age",age);
-      out->psarecord.record("cohort",cohort);
-      out->psarecord.record("psa",psa_last_screen);
-      out->psarecord.record("t0",t0);
-      out->psarecord.record("beta0",beta0);
-      out->psarecord.record("beta1",beta1);
-      out->psarecord.record("beta2",beta2);
-      out->psarecord.record("Z",Z);
-      out->psarecord.record("onset",double(onset_p()));
-      out->psarecord.record("detectable",double(detectable));
+    if (in->par.includePSArecords) {
+      double* r = out->psarecord.add();
+      r[PsaRecord::id] = id;
+      r[PsaRecord::state] = state;
+      r[PsaRecord::ext_grade] = ext_grade;
+      r[PsaRecord::organised] = organised; // only meaningful for mixed_programs
+      r[PsaRecord::dx] = dx;
+      r[PsaRecord::age] = age;
+      r[PsaRecord::cohort] = cohort;
+      r[PsaRecord::psa] = psa_last_screen;
+      r[PsaRecord::t0] = t0;
+      r[PsaRecord::beta0] = beta0;
+      r[PsaRecord::beta1] = beta1;
+      r[PsaRecord::beta2] = beta2;
+      r[PsaRecord::Z] = Z;
+      r[PsaRecord::onset] = double(onset_p());
+      r[PsaRecord::detectable] = double(detectable);
     }
     if (!everPSA) {
       if (id < in->nLifeHistories) {
-	out->outParameters.revise("age_psa",now());
+	out->outParameters.last()[ParameterRecord::age_psa] = now();
 	// outParameters.revise("first_psa",psa);
       }
       everPSA = true;
     }
     if (formal_costs) {
-      add_costs("Invitation");
-      lost_productivity(in->panel && psa>=in->parameter["panelReflexThreshold"] ? "Formal panel" : "Formal PSA");
-      add_costs(in->panel && psa>=in->parameter["panelReflexThreshold"] ? "Formal panel" : "Formal PSA");
-      scheduleUtilityChange(now(), "Formal PSA");
+      add_costs(Category::Invitation);
+      lost_productivity(in->panel && psa>=in->par.panelReflexThreshold ? Category::FormalPanel : Category::FormalPSA);
+      add_costs(in->panel && psa>=in->par.panelReflexThreshold ? Category::FormalPanel : Category::FormalPSA);
+      scheduleUtilityChange(now(), Category::FormalPSA);
     } else { // opportunistic costs
-      add_costs(in->panel && psa>=in->parameter["panelReflexThreshold"] ? "Opportunistic panel" : "Opportunistic PSA");
-      lost_productivity(in->panel && psa>=in->parameter["panelReflexThreshold"] ? "Opportunistic panel" : "Opportunistic PSA");
-      scheduleUtilityChange(now(), "Opportunistic PSA");
+      add_costs(in->panel && psa>=in->par.panelReflexThreshold ? Category::OpportunisticPanel : Category::OpportunisticPSA);
+      lost_productivity(in->panel && psa>=in->par.panelReflexThreshold ? Category::OpportunisticPanel : Category::OpportunisticPSA);
+      scheduleUtilityChange(now(), Category::OpportunisticPSA);
     }
     compliance = formal_compliance ?
       in->tableFormalBiopsyCompliance(bounds<double>(psa,3.0,10.0),
-				  bounds<double>(age,40,80)) :
+				  bounds<double>(age,40,80))[0] :
       in->tableOpportunisticBiopsyCompliance(bounds<double>(psa,3.0,10.0),
-					 bounds<double>(age,40,80));
+					 bounds<double>(age,40,80))[0];
     bool positive_test =
-      (msg->kind == toScreen && psa >= in->parameter["psaThreshold"]) ? true :
-      (msg->kind == toBiopsyFollowUpScreen && psa >= in->parameter["psaThresholdBiopsyFollowUp"]) ? true :
+      (msg->kind == toScreen && psa >= in->par.psaThreshold) ? true :
+      (msg->kind == toBiopsyFollowUpScreen && psa >= in->par.psaThresholdBiopsyFollowUp) ? true :
       false;
     // Important case: PSA<1 (to check)
     // Reduce false positives wrt Gleason 7+ by 1-rFPF: which BPThreshold?
     if (in->panel && positive_test && psa < 10.) {
-      if (int(in->parameter("biomarker_model"))==random_correction) { // simplistic model for the biomarker
-	if (R::runif(0.0,1.0) < 1.0 - in->parameter["rFPF"])
+      if (in->par.biomarker_model==random_correction) { // simplistic model for the biomarker
+	if (rng->runif(0.0,1.0) < 1.0 - in->par.rFPF)
 	  positive_test = false;
       }
-      else if (int(in->parameter("biomarker_model"))==psa_informed_correction) { // PSA based model for the biomarker
+      else if (in->par.biomarker_model==psa_informed_correction) { // PSA based model for the biomarker
 	if ((ext_grade == ext::Gleason_le_6 &&
-	     detectable && psa < in->parameter["PSA_FP_threshold_GG6"]) // FP GG 6 PSA threshold
-	    ||  (!detectable && psa < in->parameter["PSA_FP_threshold_nCa"]) // FP no cancer PSA threshold
+	     detectable && psa < in->par.PSA_FP_threshold_GG6) // FP GG 6 PSA threshold
+	    ||  (!detectable && psa < in->par.PSA_FP_threshold_nCa) // FP no cancer PSA threshold
 	    || ((ext_grade == ext::Gleason_7 || ext_grade == ext::Gleason_ge_8) &&
-		detectable && psa < in->parameter["PSA_FP_threshold_GG7plus"])) { // FP GG >= 7 PSA threshold
+		detectable && psa < in->par.PSA_FP_threshold_GG7plus)) { // FP GG >= 7 PSA threshold
 	  positive_test = false; // assumption relying on PSA being a strong panel component
           if (in->debug) Rprintf("Panel adjusted tests id=%i, psa=%8.6f, ext_grade=%i, future_ext_grade=%i, onset=%d, detectable=%d\n", id, psa, ext_grade, future_ext_grade, onset_p(), detectable);
 	}
       }
-      else {
-	REprintf("Parameter biomarker_model not matched: %i\n", int(in->parameter("biomarker_model")));
-      }
+      // other biomarker models are rejected by callFhcrc()
     }
     // Case: PSA>=10. The man has a positive_test.
-    if (in->bparameter["includePSArecords"] && !onset_p() && positive_test) {
-      out->falsePositives.record("id",id);
-      out->falsePositives.record("psa",psa);
-      out->falsePositives.record("age",now());
-      out->falsePositives.record("age0",t0+35.0);
-      out->falsePositives.record("ext_grade",ext_grade);
+    if (in->par.includePSArecords && !onset_p() && positive_test) {
+      double* r = out->falsePositives.add();
+      r[FalsePositiveRecord::id] = id;
+      r[FalsePositiveRecord::psa] = psa;
+      r[FalsePositiveRecord::age] = now();
+      r[FalsePositiveRecord::age0] = t0+35.0;
+      r[FalsePositiveRecord::ext_grade] = ext_grade;
     }
     // if (panel && !positive_test && t0<now()-35.0 && ext_grade > ext::Gleason_le_6) {
     //   if (R::runif(0.0,1.0) < 1.0-parameter["rTPF"]) positive_test = true;
     // }
-    if (positive_test && R::runif(0.0,1.0) < compliance) {
+    if (positive_test && rng->runif(0.0,1.0) < compliance) {
       scheduleAt(now()+1.0/52.0, toScreenInitiatedBiopsy); // biopsy in one month
     } // assumes similar biopsy compliance, reasonable? An option to different psa-thresholds would be to use different biopsyCompliance. /AK
     else
       rescreening_schedules(psa, organised, mixed_programs);
-    in->rngNh->set();
+    rng->set(NhStream);
   } break;
 
   case toClinicalDiagnosis:
-    scheduleUtilityChange(now(), "Cancer diagnosis");
+    scheduleUtilityChange(now(), Category::CancerDiagnosis);
     dx = ClinicalDiagnosis;
     cancel_events_after_diagnosis();
     scheduleAt(now()+1.0/12.0, toTreatment);
     if (id < in->nLifeHistories) {
-      out->outParameters.revise("age_pca",now());
+      out->outParameters.last()[ParameterRecord::age_pca] = now();
     }
     break;
 
   case toScreenDiagnosis:
-    scheduleUtilityChange(now(), "Cancer diagnosis");
+    scheduleUtilityChange(now(), Category::CancerDiagnosis);
     // add cost for half a subsequent consultation
-    add_costs("Assessment", Direct, 0.5);
+    add_costs(Category::Assessment, Direct, 0.5);
     dx = ScreenDiagnosis;
     cancel_events_after_diagnosis();
     scheduleAt(now()+1.0/12.0, toTreatment); // treatment one month after the diagnosis
@@ -1033,7 +2979,7 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
       scheduleAt(now(), toOverDiagnosis);
     }
     if (id < in->nLifeHistories) {
-      out->outParameters.revise("age_pca",now());
+      out->outParameters.last()[ParameterRecord::age_pca] = now();
     }
     break;
 
@@ -1045,60 +2991,61 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
 
   // record additional biopsies for clinical diagnoses
   case toClinicalDiagnosticBiopsy:
-    add_costs("Biopsy");
-    add_costs("Assessment");
-    lost_productivity("Biopsy");
-    lost_productivity("Assessment");
-    scheduleUtilityChange(now(), "Biopsy");
+    add_costs(Category::Biopsy);
+    add_costs(Category::Assessment);
+    lost_productivity(Category::Biopsy);
+    lost_productivity(Category::Assessment);
+    scheduleUtilityChange(now(), Category::Biopsy);
     break;
 
   case toScreenInitiatedBiopsy:
-    in->rngScreen->set();
-    add_costs("Biopsy");
-    add_costs("Assessment");
-    lost_productivity("Biopsy");
-    lost_productivity("Assessment");
-    scheduleUtilityChange(now(), "Biopsy");
+    rng->set(ScreenStream);
+    add_costs(Category::Biopsy);
+    add_costs(Category::Assessment);
+    lost_productivity(Category::Biopsy);
+    lost_productivity(Category::Assessment);
+    scheduleUtilityChange(now(), Category::Biopsy);
 
     // output biopsy record
-    if (in->bparameter["includeBxrecords"]) {
-      out->bxrecord.record("id",id);
-      out->bxrecord.record("state",state);
-      out->bxrecord.record("ext_state",ext_state);
-      out->bxrecord.record("ext_grade",ext_grade);
-      out->bxrecord.record("organised",organised); // only meaningful for mixed_programs
-      out->bxrecord.record("dx",dx);
-      out->bxrecord.record("age",age);
-      out->bxrecord.record("cohort",cohort);
-      out->bxrecord.record("psa",psa_last_screen);
-      out->bxrecord.record("t0",t0);
-      out->bxrecord.record("beta0",beta0);
-      out->bxrecord.record("beta1",beta1);
-      out->bxrecord.record("beta2",beta2);
-      out->bxrecord.record("Z",Z);
-      out->bxrecord.record("onset",double(onset_p()));
-      out->bxrecord.record("detectable",double(detectable));
+    if (in->par.includeBxrecords) {
+      double* r = out->bxrecord.add();
+      r[BxRecord::id] = id;
+      r[BxRecord::state] = state;
+      r[BxRecord::ext_state] = ext_state;
+      r[BxRecord::ext_grade] = ext_grade;
+      r[BxRecord::organised] = organised; // only meaningful for mixed_programs
+      r[BxRecord::dx] = dx;
+      r[BxRecord::age] = age;
+      r[BxRecord::cohort] = cohort;
+      r[BxRecord::psa] = psa_last_screen;
+      r[BxRecord::t0] = t0;
+      r[BxRecord::beta0] = beta0;
+      r[BxRecord::beta1] = beta1;
+      r[BxRecord::beta2] = beta2;
+      r[BxRecord::Z] = Z;
+      r[BxRecord::onset] = double(onset_p());
+      r[BxRecord::detectable] = double(detectable);
     }
 
     if (detectable) { // diagnosed
       scheduleAt(now()+3.0/52.0, toScreenDiagnosis); // diagnosis three weeks after biopsy
       if (in->panel && state==Localised && ext_grade == ext::Gleason_le_6) {
         // fixed costs etc for men who were S3M+/PE-
-        add_costs("Assessment", Direct, 766.0/722.0 - 1.0);
-        lost_productivity("Assessment", 766.0/722.0 - 1.0);
+        add_costs(Category::Assessment, Direct, 766.0/722.0 - 1.0);
+        lost_productivity(Category::Assessment, 766.0/722.0 - 1.0);
       }
     } else { // negative biopsy
       if (in->panel) { // fixed costs etc for men who were S3M+/PE-
-        add_costs("Assessment", Direct, 1535.0/1381.0 - 1.0);
-        lost_productivity("Assessment", 1535.0/1381.0 - 1.0);
+        add_costs(Category::Assessment, Direct, 1535.0/1381.0 - 1.0);
+        lost_productivity(Category::Assessment, 1535.0/1381.0 - 1.0);
       }
       if (!previousNegativeBiopsy) { // first negative biopsy
         previousNegativeBiopsy=true;
 
         // Competing risk for event following a negative biopsy
-        double timeToPSA = R::rlnorm(in->tableNegBiopsyToPSAmeanlog(age),
+        double timeToPSA = rng->rlnorm(in->tableNegBiopsyToPSAmeanlog(age),
                                      in->tableNegBiopsyToPSAsdlog(age));
-        double timeToBiopsy = R::rlnorm(in->tableNegBiopsyToBiopsymeanlog(age),
+        double timeToBiopsy = rng->rlnorm(in->tableNegBiopsyToBiopsymeanlog(age),
                                         in->tableNegBiopsyToBiopsysdlog(age));
         if (timeToPSA <= timeToBiopsy) { // PSA was the first event
           scheduleAt(now() + timeToPSA, toScreen);
@@ -1110,15 +3057,15 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
         previousNegativeBiopsy = false;
       }
     }
-    in->rngNh->set();
+    rng->set(NhStream);
     break;
 
   case toTreatment: { // To diagnoses, treatment & survival
-    in->rngTreatment->set();
-    double u_tx = R::runif(0.0,1.0);
-    double u_adt = R::runif(0.0,1.0);
+    rng->set(TreatmentStream);
+    double u_tx = rng->runif(0.0,1.0);
+    double u_adt = rng->runif(0.0,1.0);
     if (state == Metastatic) {
-      lost_productivity("Metastatic cancer");
+      lost_productivity(Category::MetastaticCancer);
       // utilities->clear(); // should this be age-specific??
     }
     else { // Loco-regional
@@ -1131,7 +3078,7 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
 	in->pradt(tx,
 	      bounds<double>(now(),50,79),
 	      bounds<double>(year,1973,2004),
-	      grade);
+	      grade)[0];
       if (u_adt < pADT)  {
 	adt = true;
 	scheduleAt(now(), toADT);
@@ -1139,7 +3086,7 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
       if (in->debug) Rprintf("id=%i, adt=%d, u=%8.6f, pADT=%8.6f\n",id,adt,u_adt,pADT);
     }
     // reset the random number stream
-    in->rngNh->set();
+    rng->set(NhStream);
     // check for cure
     bool cured = false;
     double age_c = (state == Localised) ? tc + 35.0 : tmc + 35.0;
@@ -1147,116 +3094,116 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
     // calculate the age at cancer death by c_benefit_type
     double age_cancer_death=R_PosInf;
     double age_cd = R_PosInf, age_sd = R_PosInf, weight = R_PosInf;
-    if (in->parameter["c_benefit_type"]==LeadTimeBased) { // [new paper ref]
-      double pcure = pow(1 - exp(-lead_time * in->parameter["c_benefit_value1"]),
+    if (in->par.c_benefit_type==LeadTimeBased) { // [new paper ref]
+      double pcure = pow(1 - exp(-lead_time * in->par.c_benefit_value1),
       			 calculate_mortality_hr(age_c));
       if (in->debug) Rprintf("hr for lead time=%f\n", calculate_mortality_hr(age_c));
-      cured = (R::runif(0.0,1.0) < pcure);
+      cured = (rng->runif(0.0,1.0) < pcure);
       if (!cured) {
-	double u_surv = R::runif(0.0,1.0);
+	double u_surv = rng->runif(0.0,1.0);
         age_cancer_death = calculate_survival(u_surv,age_c,age_c,calculate_treatment(u_tx,age_c,year+lead_time));
       }
     }
-    else if (in->parameter["c_benefit_type"]==StageShiftBased) { // [annals paper ref]
+    else if (in->par.c_benefit_type==StageShiftBased) { // [annals paper ref]
       // calculate survival
-      double u_surv = R::runif(0.0,1.0);
+      double u_surv = rng->runif(0.0,1.0);
       age_cd = calculate_survival(u_surv,age_c,age_c,calculate_treatment(u_tx,age_c,year+lead_time));
       age_sd = calculate_survival(u_surv,now(),age_c,tx);
-      weight = exp(- in->parameter["c_benefit_value0"]*lead_time);
+      weight = exp(- in->par.c_benefit_value0*lead_time);
       age_cancer_death = weight*age_cd + (1.0-weight)*age_sd;
     }
-    else REprintf("c_benefit_type not matched.");
+    // other types are rejected by callFhcrc()
     if (!cured) {
       scheduleAt(age_cancer_death, toCancerDeath);
       // Disutilities prior to a cancer death
-      double age_palliative = age_cancer_death - in->utility_duration["Palliative therapy"] - in->utility_duration["Terminal illness"];
-      double age_terminal = age_cancer_death - in->utility_duration["Terminal illness"];
+      double age_palliative = age_cancer_death - in->utility_duration[Category::PalliativeTherapy] - in->utility_duration[Category::TerminalIllness];
+      double age_terminal = age_cancer_death - in->utility_duration[Category::TerminalIllness];
       if (age_palliative>now()) { // cancer death more than 36 months after diagnosis
 	scheduleUtilityChange(age_palliative, age_terminal,
-			      in->utility_estimates["Palliative therapy"]);
-	scheduleUtilityChange(age_terminal, "Terminal illness");
+			      in->utility_estimates[Category::PalliativeTherapy]);
+	scheduleUtilityChange(age_terminal, Category::TerminalIllness);
       }
       else if (age_terminal>now()) { // cancer death between 36 and 6 months of diagnosis
-	scheduleUtilityChange(now(), age_terminal, in->utility_estimates["Palliative therapy"]);
-	scheduleUtilityChange(age_terminal,"Terminal illness");
+	scheduleUtilityChange(now(), age_terminal, in->utility_estimates[Category::PalliativeTherapy]);
+	scheduleUtilityChange(age_terminal,Category::TerminalIllness);
       }
       else // cancer death within 6 months of diagnosis/treatment
-	scheduleUtilityChange(now(), "Terminal illness");
-    }
-    if (in->bparameter["includeDiagnoses"]) {
-      out->diagnoses.record("id",id);
-      out->diagnoses.record("age",age);
-      out->diagnoses.record("year",year);
-      out->diagnoses.record("psa",psa_last_screen);
-      out->diagnoses.record("ext_grade",ext_grade);
-      out->diagnoses.record("ext_state",ext_state);
-      out->diagnoses.record("organised",organised); // only meaningful for mixed_program, keep this?
-      out->diagnoses.record("dx",dx);
-      out->diagnoses.record("tx",tx);
-      out->diagnoses.record("cancer_death",(aoc>age_cancer_death) ? 1.0 : 0.0);
-      out->diagnoses.record("age_at_death", (aoc>age_cancer_death) ? age_cancer_death : aoc);
-      out->diagnoses.record("age_cancer_death", age_cancer_death);
-      out->diagnoses.record("aoc", aoc);
-      out->diagnoses.record("age_cd", age_cd);
-      out->diagnoses.record("age_sd", age_sd);
-      out->diagnoses.record("weight", weight);
-      out->diagnoses.record("lead_time", lead_time);
+	scheduleUtilityChange(now(), Category::TerminalIllness);
+    }
+    if (in->par.includeDiagnoses) {
+      double* r = out->diagnoses.add();
+      r[DiagnosisRecord::id] = id;
+      r[DiagnosisRecord::age] = age;
+      r[DiagnosisRecord::year] = year;
+      r[DiagnosisRecord::psa] = psa_last_screen;
+      r[DiagnosisRecord::ext_grade] = ext_grade;
+      r[DiagnosisRecord::ext_state] = ext_state;
+      r[DiagnosisRecord::organised] = organised; // only meaningful for mixed_program, keep this?
+      r[DiagnosisRecord::dx] = dx;
+      r[DiagnosisRecord::tx] = tx;
+      r[DiagnosisRecord::cancer_death] = (aoc>age_cancer_death) ? 1.0 : 0.0;
+      r[DiagnosisRecord::age_at_death] = (aoc>age_cancer_death) ? age_cancer_death : aoc;
+      r[DiagnosisRecord::age_cancer_death] = age_cancer_death;
+      r[DiagnosisRecord::aoc] = aoc;
+      r[DiagnosisRecord::age_cd] = age_cd;
+      r[DiagnosisRecord::age_sd] = age_sd;
+      r[DiagnosisRecord::weight] = weight;
+      r[DiagnosisRecord::lead_time] = lead_time;
     }
   } break;
 
   case toRP:
-    add_costs("Prostatectomy");
+    add_costs(Category::Prostatectomy);
     scheduleAt(now() + 1.0, toYearlyPostTxFollowUp);
-    lost_productivity("Prostatectomy");
+    lost_productivity(Category::Prostatectomy);
     // Scheduling utilities for the first 2 months after procedure
-    scheduleUtilityChange(now(), "Prostatectomy part 1");
+    scheduleUtilityChange(now(), Category::ProstatectomyPart1);
     // Scheduling utilities for the first 3-12 months after procedure
-    scheduleUtilityChange(now() + in->utility_duration["Prostatectomy part 1"],
-			  "Prostatectomy part 2");
-    scheduleUtilityChange(now() + in->utility_duration["Prostatectomy part 1"] +
-                          in->utility_duration["Prostatectomy part 2"], "Postrecovery period");
+    scheduleUtilityChange(now() + in->utility_duration[Category::ProstatectomyPart1],
+			  Category::ProstatectomyPart2);
+    scheduleUtilityChange(now() + in->utility_duration[Category::ProstatectomyPart1] +
+                          in->utility_duration[Category::ProstatectomyPart2], Category::PostrecoveryPeriod);
     // Remove yearly active surveillance if the RP is the secondary Tx
-    RemoveKind(toYearlyActiveSurveillance); // breaks recursive call
-    RemoveKind(toRT);
+    RemoveKinds(kind_bit(toYearlyActiveSurveillance) | kind_bit(toRT)); // breaks recursive call
     break;
 
   case toRT:
-    add_costs("Radiation therapy");
+    add_costs(Category::RadiationTherapy);
     scheduleAt(now() + 1.0, toYearlyPostTxFollowUp);
-    lost_productivity("Radiation therapy");
+    lost_productivity(Category::RadiationTherapy);
     // Scheduling utilities for the first 2 months after procedure
-    scheduleUtilityChange(now(), "Radiation therapy part 1");
+    scheduleUtilityChange(now(), Category::RadiationTherapyPart1);
     // Scheduling utilities for the first 3-12 months after procedure
-    scheduleUtilityChange(now() + in->utility_duration["Radiation therapy part 1"],
-			  "Radiation therapy part 2");
-    scheduleUtilityChange(now() + in->utility_duration["Radiation therapy part 1"] +
-                          in->utility_duration["Radiation therapy part 2"], "Postrecovery period");
+    scheduleUtilityChange(now() + in->utility_duration[Category::RadiationTherapyPart1],
+			  Category::RadiationTherapyPart2);
+    scheduleUtilityChange(now() + in->utility_duration[Category::RadiationTherapyPart1] +
+                          in->utility_duration[Category::RadiationTherapyPart2], Category::PostrecoveryPeriod);
     RemoveKind(toYearlyActiveSurveillance); // breaks recursive call
     break;
 
   case toCM:
-    add_costs("Active surveillance - single MR"); // expand here
+    add_costs(Category::ActiveSurveillanceSingleMR); // expand here
     scheduleAt(now(), toYearlyActiveSurveillance);
-    scheduleUtilityChange(now(), "Active surveillance");
+    scheduleUtilityChange(now(), Category::ActiveSurveillance);
     // Modelling for possible subsequent RP and RT. P(RP|RT) ~ P(RP)
     // whereas P(RT|RP) << P(RT). As a simplification, we simulate
     // separately for RP and RT and remove an RT following an RP.
-    if (R::runif(0.0,1.0) > in->tableCMtoRPpnever(age)) {// pnever -> pever
-      scheduleAt(now() + R::rlnorm(in->tableCMtoRPmeanlog(age), in->tableCMtoRPsdlog(age)), toRP);
+    if (rng->runif(0.0,1.0) > in->tableCMtoRPpnever(age)) {// pnever -> pever
+      scheduleAt(now() + rng->rlnorm(in->tableCMtoRPmeanlog(age), in->tableCMtoRPsdlog(age)), toRP);
     }
-    if (R::runif(0.0,1.0) > in->tableCMtoRTpnever(age)) {// pnever -> pever
-      scheduleAt(now() + R::rlnorm(in->tableCMtoRTmeanlog(age), in->tableCMtoRTsdlog(age)), toRT);
+    if (rng->runif(0.0,1.0) > in->tableCMtoRTpnever(age)) {// pnever -> pever
+      scheduleAt(now() + rng->rlnorm(in->tableCMtoRTmeanlog(age), in->tableCMtoRTsdlog(age)), toRT);
     }
     break;
 
   case toYearlyActiveSurveillance:
-    add_costs("Active surveillance - yearly");
-    lost_productivity("Active surveillance - yearly");
+    add_costs(Category::ActiveSurveillanceYearly);
+    lost_productivity(Category::ActiveSurveillanceYearly);
     scheduleAt(now() + 1.0, toYearlyActiveSurveillance);
     break;
 
   case toYearlyPostTxFollowUp: // not active surveillance
-    add_costs("Post-Tx follow-up - yearly");
+    add_costs(Category::PostTxFollowUpYearly);
     scheduleAt(now() + 1.0, toYearlyPostTxFollowUp);
     break;
 
@@ -1270,199 +3217,931 @@ void FhcrcPerson::handleMessage(const cMessage* msg) {
       utilities->handleMessage(msg);
     } break;
 
-  default:
-    REprintf("No valid kind of event: %i\n",msg->kind);
+  default: // reported after the workers finish (REprintf is not thread-safe)
+    out->unknownKind = msg->kind;
     break;
 
   } // switch
 
 } // handleMessage()
 
+  /**
+     @brief The birth cohorts of the men, run-length encoded as (cohort,
+     count) pairs, so that the memory does not grow with the number of
+     men. Man i has cohort (*this)[i].
+
+     The men are in cohort order unless interleave() is called. Man i
+     then has the cohort of man i*stride modulo size() in cohort order,
+     with the stride coprime to size() and close to size() over the
+     golden ratio (a Weyl sequence), so that every batch of men is from
+     the whole population.
+  */
+  class CohortSequence {
+  public:
+    vector<double> values;
+    vector<long> ends; // cumulative counts
+    boost::uint64_t stride; // 0 for cohort order
+    CohortSequence() : stride(0) {}
+    /** From (cohort, count) pairs */
+    CohortSequence(const double* cohorts, const double* counts, int nruns) : stride(0) {
+      for (int k = 0; k < nruns; ++k)
+	push_back(cohorts[k], long(counts[k]));
+    }
+    void push_back(double cohort, long count) {
+      if (count <= 0) return;
+      long end = size() + count;
+      if (!values.empty() && values.back() == cohort)
+	ends.back() = end;
+      else {
+	values.push_back(cohort);
+	ends.push_back(end);
+      }
+    }
+    void interleave() {
+      boost::uint64_t n = size();
+      stride = boost::uint64_t(0.6180339887498949 * n);
+      while (gcd(stride, n) != 1) ++stride;
+    }
+    long size() const { return ends.empty() ? 0L : ends.back(); }
+    double operator[](long i) const {
+      if (stride != 0) i = long(boost::uint64_t(i) * stride % boost::uint64_t(size()));
+      return values[upper_bound(ends.begin(), ends.end(), i) - ends.begin()];
+    }
+    /** The men first, ..., last-1 as (cohort, count) pairs in cohort order */
+    List counts(long first, long last) const {
+      vector<int> count(values.size());
+      if (stride == 0) // intersect the runs with first, ..., last-1
+	for (size_t k = 0; k < values.size(); ++k) {
+	  long begin = (k == 0) ? 0L : ends[k-1];
+	  count[k] = int(max(0L, min(last, ends[k]) - max(first, begin)));
+	}
+      else
+	for (long i = first; i < last; ++i)
+	  ++count[upper_bound(ends.begin(), ends.end(), long(boost::uint64_t(i) * stride % boost::uint64_t(size()))) - ends.begin()];
+      vector<double> cohorts;
+      vector<int> counts;
+      for (size_t k = 0; k < values.size(); ++k)
+	if (count[k] > 0) {
+	  cohorts.push_back(values[k]);
+	  counts.push_back(count[k]);
+	}
+      return List::create(_("cohort") = Rcpp::wrap(cohorts), _("count") = Rcpp::wrap(counts));
+    }
+  private:
+    static boost::uint64_t gcd(boost::uint64_t a, boost::uint64_t b) {
+      while (b != 0) {
+	boost::uint64_t r = a % b;
+	a = b;
+	b = r;
+      }
+      return a;
+    }
+  };
+
+  /**
+     @brief Simulation context for one worker thread: its own event
+     queue, person, utilities, output and random number streams.
+  */
+  class SimWorker {
+  public:
+    SimInput* in;
+    vector<SimOutput*> outs; // one per scenario
+    SimOutput* out; // for the current scenario
+    int men, expectedMen; // simulated by this worker, and expected in total
+    Utilities utilities;
+    EventQueue queue;
+    WorkerRng rng;
+    FhcrcPerson person;
+    vector<NaturalHistory> histories; // for the current block
+    SimWorker(SimInput* in, const vector<SimOutput*>& outs, int expectedMen) :
+      in(in), outs(outs), out(outs[0]), men(0), expectedMen(expectedMen),
+      utilities(in->par.utility_scale, in->par.utility_truncate, in->par.utility_background_analytic),
+      rng(*in), person(in, out, &utilities, &queue, &rng, 1, 2000) {
+      queue.calendar = in->par.calendar_queue;
+    }
+    /**
+       Simulate men first, ..., last-1, where man i uses substream i of
+       the initial random number streams. The natural histories are drawn
+       once and shared by the scenarios; each scenario starts the other
+       streams from the same substreams (common random numbers). The
+       sums for the block are then added to the exact totals, so that
+       they do not depend on which worker ran which blocks.
+    */
+    void run(int first, int last, const CohortSequence& cohort, int firstId) {
+      // draw the natural histories for the block before the event loops
+      histories.resize(last - first);
+      rng.seek(first);
+      for (int i = first; i < last; ++i) {
+	FhcrcPerson sampler(in, out, &utilities, &queue, &rng, i+firstId, cohort[i]);
+	sampler.sampleNaturalHistory();
+	histories[i-first] = sampler.naturalHistory();
+	rng.nextSubstream();
+      }
+      for (size_t k = 0; k < outs.size(); ++k) {
+	out = outs[k];
+	queue.profile = out->profiling ? &out->profile : NULL;
+	rng.seek(first);
+	for (int i = first; i < last; ++i) {
+	  person = FhcrcPerson(in, out, &utilities, &queue, &rng, i+firstId, cohort[i], &histories[i-first]);
+	  person.setPolicy(in->policies[k]);
+	  if (person.healthyLife_p()) {
+	    person.healthyLife();
+	    if (queue.profile) { // no events handled
+	      queue.profile->persons++;
+	      queue.profile->eventsPerPerson[0L]++;
+	    }
+	  }
+	  else queue.run_simulation(person);
+	  out->endPerson();
+	  queue.clear();
+	  rng.nextSubstream();
+	}
+	out->flush();
+	// after the first block, reserve the records at the observed rate
+	if (men == 0 && expectedMen > last - first)
+	  out->reserve(double(expectedMen) / (last - first));
+      }
+      men += last - first;
+    }
+  };
+
+  /**
+     @brief Writes scalars, vectors and maps of scalars to a binary file
+     in native byte order, for checkpoint() methods. CheckpointReader
+     reads them back in the same order.
+  */
+  class CheckpointWriter {
+  public:
+    FILE* file;
+    bool ok;
+    CheckpointWriter(FILE* file) : file(file), ok(file != NULL) {}
+    template<class T> void io(T& x) {
+      ok = ok && fwrite(&x, sizeof(T), 1, file) == 1;
+    }
+    template<class T> void io(vector<T>& v) {
+      boost::int64_t n = v.size();
+      io(n);
+      if (n > 0) ok = ok && fwrite(&v[0], sizeof(T), n, file) == size_t(n);
+    }
+    template<class K, class V> void io(map<K,V>& m) {
+      boost::int64_t n = m.size();
+      io(n);
+      for (typename map<K,V>::iterator it = m.begin(); it != m.end(); ++it) {
+	K key = it->first;
+	io(key);
+	io(it->second);
+      }
+    }
+  };
+  class CheckpointReader {
+  public:
+    FILE* file;
+    bool ok;
+    CheckpointReader(FILE* file) : file(file), ok(file != NULL) {}
+    template<class T> void io(T& x) {
+      ok = ok && fread(&x, sizeof(T), 1, file) == 1;
+    }
+    template<class T> void io(vector<T>& v) {
+      boost::int64_t n = 0;
+      io(n);
+      if (!ok || n < 0) { ok = false; return; }
+      v.resize(n);
+      if (n > 0) ok = ok && fread(&v[0], sizeof(T), n, file) == size_t(n);
+    }
+    template<class K, class V> void io(map<K,V>& m) {
+      boost::int64_t n = 0;
+      io(n);
+      m.clear();
+      for (boost::int64_t i = 0; ok && i < n; ++i) {
+	K key;
+	io(key);
+	io(m[key]);
+      }
+    }
+  };
+
+  /**
+     Merge the results of the workers for each scenario into outs[k] as
+     a tree reduction. The merged workers are cleared for further use, or
+     released.
+  */
+  void mergeOutputs(vector<SimOutput>& outs, int nthreads, int nscreens, bool release) {
+    for (int stride = 1; stride < nthreads; stride *= 2) {
+#pragma omp parallel for num_threads(nthreads) schedule(static)
+      for (int t = 0; t < nthreads - stride; t += 2*stride)
+	for (int k = 0; k < nscreens; ++k) {
+	  SimOutput& from = outs[(t+stride)*nscreens + k];
+	  outs[t*nscreens + k].append(from);
+	  if (release) from = SimOutput();
+	  else from.clearResults();
+	}
+    }
+  }
+
+  /**
+     @brief The run that a checkpoint or result file is for: the number
+     of men, the slice first, ..., last-1, the birth cohorts of the men
+     as (cohort, count) pairs and whether they are interleaved, the
+     scenarios, the initial state of the natural history stream and the
+     scalar parameters. The next man is the first man not yet in the
+     results.
+  */
+  class CheckpointHeader {
+  public:
+    boost::int32_t n, first, last, nextMan, interleaved;
+    vector<double> cohorts;
+    vector<boost::int64_t> counts;
+    vector<boost::int32_t> screens;
+    vector<boost::int64_t> seed;
+    vector<double> parameters; // numeric, then logical
+    CheckpointHeader() : n(0), first(0), last(0), nextMan(0), interleaved(0) {}
+    CheckpointHeader(const SimInput& in, int n, int first, int last, const CohortSequence& cohort) :
+      n(n), first(first), last(last), nextMan(first), interleaved(cohort.stride != 0),
+      cohorts(cohort.values), counts(cohort.ends.size()),
+      screens(in.screens.begin(), in.screens.end()),
+      parameters(in.parameter.values.begin(), in.parameter.values.end()) {
+      for (size_t k = 0; k < counts.size(); ++k)
+	counts[k] = cohort.ends[k] - (k == 0 ? 0L : cohort.ends[k-1]);
+      unsigned long state[6];
+      in.rngNh->GetState(state);
+      seed.assign(state, state + 6);
+      parameters.insert(parameters.end(), in.bparameter.values.begin(), in.bparameter.values.end());
+    }
+    template<class Archive>
+    void checkpoint(Archive& ar) {
+      ar.io(n); ar.io(first); ar.io(last); ar.io(nextMan); ar.io(interleaved);
+      ar.io(cohorts); ar.io(counts);
+      ar.io(screens); ar.io(seed); ar.io(parameters);
+    }
+    /** The same population, scenarios, random numbers and parameters? */
+    bool sameRun(const CheckpointHeader& other) const {
+      // parameters are compared bitwise, so that NA matches NA
+      return n == other.n && interleaved == other.interleaved &&
+	cohorts == other.cohorts && counts == other.counts &&
+	screens == other.screens && seed == other.seed &&
+	parameters.size() == other.parameters.size() &&
+	(parameters.empty() ||
+	 memcmp(&parameters[0], &other.parameters[0], parameters.size() * sizeof(double)) == 0);
+    }
+    bool sameSlice(const CheckpointHeader& other) const {
+      return first == other.first && last == other.last;
+    }
+  };
+
+  /**
+     Checkpoint file: the 8 bytes "FHCRCCK2", the CheckpointHeader, then
+     the merged results of each scenario. Each man uses his own
+     substreams, so the next man also gives the random number streams.
+     The file is written to filename.tmp and then renamed, which replaces
+     filename atomically except on Windows.
+  */
+  void writeCheckpoint(const string& filename, CheckpointHeader& header,
+		       vector<SimOutput>& outs) {
+    string tmp = filename + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    CheckpointWriter ar(file);
+    ar.ok = ar.ok && fwrite("FHCRCCK2", 1, 8, file) == 8;
+    header.checkpoint(ar);
+    for (size_t k = 0; k < header.screens.size(); ++k)
+      outs[k].checkpoint(ar);
+    bool ok = ar.ok;
+    if (file != NULL) ok = (fclose(file) == 0) && ok;
+#ifdef _WIN32
+    if (ok) remove(filename.c_str()); // rename() does not replace files on Windows
+#endif
+    if (!ok || rename(tmp.c_str(), filename.c_str()) != 0)
+      stop("cannot write checkpoint file " + filename);
+  }
+  /**
+     Read a checkpoint into outs[k] and its header into header. Returns
+     false if the file is missing or incomplete, and stops if it is not
+     for run (or, with sameSlice, for the same slice of the men).
+  */
+  bool readCheckpoint(const string& filename, const CheckpointHeader& run, bool sameSlice,
+		      CheckpointHeader& header, vector<SimOutput>& outs) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    CheckpointReader ar(file);
+    char magic[8];
+    ar.ok = ar.ok && fread(magic, 1, 8, file) == 8 && string(magic, 8) == "FHCRCCK2";
+    if (ar.ok) header.checkpoint(ar);
+    if (ar.ok && (!run.sameRun(header) || (sameSlice && !run.sameSlice(header)))) {
+      fclose(file);
+      stop("checkpoint file " + filename + " is for a different run");
+    }
+    for (size_t k = 0; ar.ok && k < run.screens.size(); ++k)
+      outs[k].checkpoint(ar);
+    if (file != NULL) fclose(file);
+    return ar.ok;
+  }
+  inline bool fileExists(const string& filename) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file != NULL) fclose(file);
+    return file != NULL;
+  }
+
+  /**
+     Have the outcome means for every scenario reached their target
+     relative standard errors? A target of zero or NA is ignored.
+  */
+  bool precisionReached(vector<SimOutput>& outs, int nthreads, int nscreens,
+			const vector<double>& precision) {
+    for (int k = 0; k < nscreens; ++k)
+      for (int j = 0; j < Outcome::N; ++j) {
+	if (!(precision[j] > 0.0)) continue;
+	MeansTotal m;
+	for (int t = 0; t < nthreads; ++t)
+	  m.append(outs[t*nscreens + k].outcomesTotal[j]);
+	if (m.n < 2) return false;
+	double mean = m.sum.value() / m.n;
+	double var = (m.sumsq.value() - m.n * mean * mean) / (m.n - 1);
+	if (mean == 0.0 || sqrt(var / m.n) / fabs(mean) > precision[j])
+	  return false;
+      }
+    return true;
+  }
+
+  /** Clear the results and set up the reports for a run */
+  void setupOutput(SimOutput& out, SimInput& in, const vector<double>& ages, bool profiling) {
+    out.clearResults();
+    out.profiling = profiling;
+    out.lifeHistorySink = LifeHistorySink();
+
+    out.report.discountRate = in.parameter["discountRate.effectiveness"];
+    out.report.setPartition(ages);
+    out.report.setStates(in.par.full_report ? in.fullStates.size() : 0, EventQueue::MaxKinds);
+    out.shortReport.discountRate = in.parameter["discountRate.effectiveness"];
+    out.shortReport.setPartition(ages);
+    out.shortReport.setStates(2, EventQueue::MaxKinds);
+    out.costs.discountRate = in.parameter["discountRate.costs"];
+    out.costs.setPartition(ages);
+  }
+
+  /**
+     Wrap the results for R. Each report is released as soon as it has
+     been copied, so that the peak memory is about the results plus the
+     largest report, rather than two copies of the results. The results
+     cannot be used afterwards.
+  */
+  List SimOutput::wrap(const FullState::Codes& fullStates) {
+    // the records by man, as the merged workers took blocks in any order
+    sortById(lifeHistories);
+    outParameters.sortById();
+    psarecord.sortById();
+    bxrecord.sortById();
+    falsePositives.sortById();
+    diagnoses.sortById();
+    List result;
+    result.push_back(costs.wrap(), "costs");                       // CostAccumulator
+    result.push_back(report.wrap(fullStates), "summary");          // StateEventReport
+    report.release();
+    result.push_back(shortReport.wrap(IntegerCodes()), "shortSummary"); // StateEventReport
+    shortReport.release();
+    result.push_back(Rcpp::wrap(lifeHistories), "lifeHistories");  // vector<LifeHistory::Type>
+    freeVector(lifeHistories);
+    result.push_back(outParameters.wrap(), "parameters");          // RecordReport
+    outParameters.release();
+    result.push_back(psarecord.wrap(), "psarecord");               // RecordReport
+    psarecord.release();
+    result.push_back(bxrecord.wrap(), "bxrecord");                 // RecordReport
+    bxrecord.release();
+    result.push_back(falsePositives.wrap(), "falsePositives");     // RecordReport
+    falsePositives.release();
+    result.push_back(diagnoses.wrap(), "diagnoses");               // RecordReport
+    diagnoses.release();
+    result.push_back(tmc_minus_t0Total.wrap(), "tmc_minus_t0");    // MeansTotal
+    List means;
+    for (int j = 0; j < Outcome::N; ++j)
+      means.push_back(outcomesTotal[j].wrap(), Outcome::names[j]);
+    result.push_back(means, "outcomes");
+    if (profiling)
+      result.push_back(profile.wrap(), "profile");
+    return result;
+  }
+
+  static void check_interrupt_fn(void *) { R_CheckUserInterrupt(); }
+  /**
+     Check for a user interrupt without a longjmp from the caller.
+  */
+  bool pending_interrupt() {
+    return !(R_ToplevelExec(check_interrupt_fn, NULL));
+  }
+
+  const int blockSize = 1000; // men per work unit
+
+  /**
+     Simulate the blocks firstBlock, ..., lastBlock-1 of the men first,
+     ..., last-1, with the workers taking blocks from a shared queue.
+     Returns true if the user interrupted the run.
+  */
+  bool runBlocks(SimInput& in, vector<SimOutput>& outs, int nthreads, int nscreens,
+		 int first, int last, int firstBlock, int lastBlock, int expectedMen,
+		 const CohortSequence& cohort, int firstId) {
+    int nextBlock = firstBlock;
+    bool interrupted = false;
+#pragma omp parallel num_threads(nthreads)
+    {
+      int thread = 0;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+#endif
+      vector<SimOutput*> workerOuts;
+      for (int k = 0; k < nscreens; ++k)
+	workerOuts.push_back(&outs[thread*nscreens + k]);
+      SimWorker worker(&in, workerOuts, expectedMen);
+      for (;;) {
+	int block;
+#pragma omp critical(fhcrc_queue)
+	block = interrupted ? lastBlock : nextBlock++;
+	if (block >= lastBlock) break;
+	worker.run(first + block*blockSize, min(last, first + (block+1)*blockSize), cohort, firstId);
+	if (outs[thread*nscreens].lifeHistorySink.file) outs[thread*nscreens].lifeHistorySink.endBlock();
+	if (thread == 0 && pending_interrupt()) { /* be polite -- did the user hit ctrl-C? */
+#pragma omp critical(fhcrc_queue)
+	  interrupted = true;
+	}
+      }
+    }
+    return interrupted;
+  }
+
+  /** The screening policies for the scenarios, from the current parameters */
+  void setPolicies(SimInput& in) {
+    in.policies.clear();
+    for (size_t k = 0; k < in.screens.size(); ++k) {
+      if (in.screens[k] < noScreening || in.screens[k] > stopped_screening)
+	stop("screening scenario not matched");
+      in.policies.push_back(ScreeningPolicy(in.screens[k], in.par));
+    }
+  }
+
+  /**
+     Read the parameters of one simulation run into SimInput: the scalar
+     parameters and the small vectors in otherParameters.
+  */
+  void readParameters(SimInput& in, List parms) {
+    in.parameter = NamedNumeric(as<NumericVector>(parms["parameter"]));
+    in.bparameter = NamedLogical(as<LogicalVector>(parms["bparameter"])); // scalar bools
+    in.par.resolve(in.parameter, in.bparameter);
+    List otherParameters = parms["otherParameters"];
+    in.debug = as<bool>(parms["debug"]);
+    if (! in.bparameter["revised_natural_history"]) {
+      in.mubeta2 = NamedNumeric(as<NumericVector>(otherParameters["mubeta2"]));
+      in.sebeta2 = NamedNumeric(as<NumericVector>(otherParameters["sebeta2"]));
+    } else {
+      in.mubeta2 = NamedNumeric(as<NumericVector>(otherParameters["rev_mubeta2"]));
+      in.sebeta2 = NamedNumeric(as<NumericVector>(otherParameters["rev_sebeta2"]));
+    }
+    NumericVector mu0 = as<NumericVector>(otherParameters["mu0"]);
+    {
+      // intern the cost and utility categories
+      NamedNumeric cost_parameters(as<NumericVector>(otherParameters["cost_parameters"]));
+      NamedNumeric utility_estimates(as<NumericVector>(otherParameters["utility_estimates"]));
+      NamedNumeric utility_duration(as<NumericVector>(otherParameters["utility_duration"]));
+      NamedNumeric lost_production_years(as<NumericVector>(otherParameters["lost_production_years"]));
+      for (int k = 0; k < Category::N; ++k) {
+        in.cost_parameters[k] = cost_parameters.get(Category::names[k], NA_REAL);
+        in.utility_estimates[k] = utility_estimates.get(Category::names[k], NA_REAL);
+        in.utility_duration[k] = utility_duration.get(Category::names[k], NA_REAL);
+        in.lost_production_years[k] = lost_production_years.get(Category::names[k], NA_REAL);
+      }
+    }
+
+    in.production = Table<double,double>(as<DataFrame>(otherParameters["production"]), "ages", "values");
+    in.nLifeHistories = as<int>(otherParameters["nLifeHistories"]);
+    in.screen = as<int>(otherParameters["screen"]);
+    in.screens.clear();
+    if (parms.containsElementNamed("screens")) {
+      IntegerVector screens = as<IntegerVector>(parms["screens"]);
+      in.screens.assign(screens.begin(), screens.end());
+    }
+    if (in.screens.empty()) in.screens.push_back(in.screen);
+    setPolicies(in);
+    if (in.debug) Rprintf("screen=%i\n",in.screen);
+    in.panel = as<bool>(parms["panel"]);
+    double ages0[106];
+    boost::algorithm::iota(ages0, ages0+106, 0.0);
+    in.rmu0 = Rpexp(&mu0[0], ages0, 106);
+  }
+
+  /**
+     Read the tables into SimInput. These do not change between runs with
+     the same tables (see the input argument of callFhcrc).
+  */
+  void readTables(SimInput& in, List parms) {
+    List tables = parms["tables"];
+    List otherParameters = parms["otherParameters"];
+    in.interp_prob_grade7 =
+      NumericInterpolate(as<DataFrame>(tables["prob_grade7"]));
+    in.prtx = GridTable(as<DataFrame>(tables["prtx"]),
+		        "Age,DxY,G","CM,RP"); // NB: Grade is now {0,1[,2]} coded cf {1,2[,3]}
+    in.pradt = GridTable(as<DataFrame>(tables["pradt"]),"Tx,Age,DxY,Grade","ADT");
+    in.hr_locoregional = GridTable(as<DataFrame>(otherParameters["hr_locoregional"]),"age,ext_grade,psa10","hr");
+    in.hr_metastatic = TableMetastaticHR(as<DataFrame>(otherParameters["hr_metastatic"]),"age","hr");
+    in.tableBiopsySensitivity = TableDD(as<DataFrame>(otherParameters["biopsy_sensitivity"]),"Year","Sensitivity");
+    in.tableNegBiopsyToPSAmeanlog = TableDD(as<DataFrame>(otherParameters["neg_biopsy_to_psa"]), "age", "meanlog");
+    in.tableNegBiopsyToPSAsdlog = TableDD(as<DataFrame>(otherParameters["neg_biopsy_to_psa"]), "age", "sdlog");
+    in.tableNegBiopsyToBiopsymeanlog = TableDD(as<DataFrame>(otherParameters["neg_biopsy_to_biopsy"]), "age", "meanlog");
+    in.tableNegBiopsyToBiopsysdlog = TableDD(as<DataFrame>(otherParameters["neg_biopsy_to_biopsy"]), "age", "sdlog");
+    in.tableCMtoRPpnever = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RP"]), "age", "pnever");
+    in.tableCMtoRPmeanlog = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RP"]), "age", "meanlog");
+    in.tableCMtoRPsdlog = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RP"]), "age", "sdlog");
+    in.tableCMtoRTpnever = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RT"]), "age", "pnever");
+    in.tableCMtoRTmeanlog = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RT"]), "age", "meanlog");
+    in.tableCMtoRTsdlog = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RT"]), "age", "sdlog");
+    in.tableSecularTrendTreatment2008OR = TableDD(as<DataFrame>(tables["secularTrendTreatment2008OR"]),"year","OR");
+    in.tableOpportunisticBiopsyCompliance = GridTable(as<DataFrame>(tables["biopsyOpportunisticComplianceTable"]),
+						      "psa,age","compliance");
+    in.tableFormalBiopsyCompliance = GridTable(as<DataFrame>(tables["biopsyFormalComplianceTable"]),
+					       "psa,age","compliance");
+    in.rescreen = GridTable(as<DataFrame>(tables["rescreening"]), "age5,total", "shape,scale,cure");
+
+    DataFrame df_survival_dist = as<DataFrame>(tables["survival_dist"]); // Grade,Time,Survival
+    DataFrame df_survival_local = as<DataFrame>(tables["survival_local"]); // Age,Grade,Time,Survival
+    // extract the columns from the survival_dist data-frame
+    IntegerVector sd_grades = df_survival_dist["Grade"];
+    NumericVector
+      sd_times = df_survival_dist["Time"],
+      sd_survivals = df_survival_dist["Survival"];
+    vector<double> sd_ages(sd_grades.size(), 0.0); // one age band
+    in.H_dist.build(sd_ages, sd_grades, sd_times, sd_survivals, sd_grades.size());
+    // now we can use: H_dist.invert(0.0,grade,-log(u))
+    // extract the columns from the data-frame
+    IntegerVector sl_grades = df_survival_local["Grade"];
+    NumericVector
+      sl_ages = df_survival_local["Age"],
+      sl_times = df_survival_local["Time"],
+      sl_survivals = df_survival_local["Survival"];
+    in.H_local.build(sl_ages, sl_grades, sl_times, sl_survivals, sl_grades.size());
+    // now we can use: H_local.invert(age,grade,-log(u))
+  }
 
 RcppExport SEXP callFhcrc(SEXP parmsIn) {
 
-  // declarations
-  SimInput in;
-  SimOutput out;
+  BEGIN_RCPP
+
+  // read in the parameters, and the tables unless an input handle is reused
+  List parms(parmsIn);
+  bool cached = parms.containsElementNamed("input") && !Rf_isNull(parms["input"]);
+  XPtr<SimInput> input = cached ? XPtr<SimInput>(SEXP(parms["input"])) : XPtr<SimInput>(new SimInput(), true);
+  SimInput& in = *input.checked_get();
+  if (!cached) readTables(in, parms);
+  readParameters(in, parms);
 
+  // the random number streams start from the current seed
+  delete in.rngNh; delete in.rngOther; delete in.rngScreen; delete in.rngTreatment;
   in.rngNh = new Rng();
   in.rngOther = new Rng();
   in.rngScreen = new Rng();
   in.rngTreatment = new Rng();
   in.rngNh->set();
-  Utilities utilities;
-
-  // read in the parameters
-  List parms(parmsIn);
-  List tables = parms["tables"];
-  in.parameter = parms["parameter"];
-  in.bparameter = parms["bparameter"]; // scalar bools
-  List otherParameters = parms["otherParameters"];
-  in.debug = as<bool>(parms["debug"]);
-  if (! in.bparameter["revised_natural_history"]) {
-    in.mubeta2 = as<NumericVector>(otherParameters["mubeta2"]);
-    in.sebeta2 = as<NumericVector>(otherParameters["sebeta2"]);
-  } else {
-    in.mubeta2 = as<NumericVector>(otherParameters["rev_mubeta2"]);
-    in.sebeta2 = as<NumericVector>(otherParameters["rev_sebeta2"]);
-  }
-  NumericVector mu0 = as<NumericVector>(otherParameters["mu0"]);
-  in.cost_parameters = as<NumericVector>(otherParameters["cost_parameters"]);
-  in.utility_estimates = as<NumericVector>(otherParameters["utility_estimates"]);
-  in.utility_duration = as<NumericVector>(otherParameters["utility_duration"]);
-  utilities.truncate = as<bool>(in.bparameter["utility_truncate"]);
-  utilities.scale = utility_scale_t(as<int>(in.parameter["utility_scale"]));
-
-  in.production = Table<double,double>(as<DataFrame>(otherParameters["production"]), "ages", "values");
-  in.lost_production_years = as<NumericVector>(otherParameters["lost_production_years"]);
 
   int n = as<int>(parms["n"]);
   int firstId = as<int>(parms["firstId"]);
-  in.interp_prob_grade7 =
-    NumericInterpolate(as<DataFrame>(tables["prob_grade7"]));
-  in.prtxCM = TablePrtx(as<DataFrame>(tables["prtx"]),
-			       "Age","DxY","G","CM"); // NB: Grade is now {0,1[,2]} coded cf {1,2[,3]}
-  in.prtxRP = TablePrtx(as<DataFrame>(tables["prtx"]),
-			       "Age","DxY","G","RP");
-  in.pradt = TablePradt(as<DataFrame>(tables["pradt"]),"Tx","Age","DxY","Grade","ADT");
-  in.hr_locoregional = TableLocoHR(as<DataFrame>(otherParameters["hr_locoregional"]),"age","ext_grade","psa10","hr");
-  in.hr_metastatic = TableMetastaticHR(as<DataFrame>(otherParameters["hr_metastatic"]),"age","hr");
-  in.tableBiopsySensitivity = TableDD(as<DataFrame>(otherParameters["biopsy_sensitivity"]),"Year","Sensitivity");
-  in.tableNegBiopsyToPSAmeanlog = TableDD(as<DataFrame>(otherParameters["neg_biopsy_to_psa"]), "age", "meanlog");
-  in.tableNegBiopsyToPSAsdlog = TableDD(as<DataFrame>(otherParameters["neg_biopsy_to_psa"]), "age", "sdlog");
-  in.tableNegBiopsyToBiopsymeanlog = TableDD(as<DataFrame>(otherParameters["neg_biopsy_to_biopsy"]), "age", "meanlog");
-  in.tableNegBiopsyToBiopsysdlog = TableDD(as<DataFrame>(otherParameters["neg_biopsy_to_biopsy"]), "age", "sdlog");
-  in.tableCMtoRPpnever = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RP"]), "age", "pnever");
-  in.tableCMtoRPmeanlog = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RP"]), "age", "meanlog");
-  in.tableCMtoRPsdlog = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RP"]), "age", "sdlog");
-  in.tableCMtoRTpnever = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RT"]), "age", "pnever");
-  in.tableCMtoRTmeanlog = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RT"]), "age", "meanlog");
-  in.tableCMtoRTsdlog = TableDD(as<DataFrame>(otherParameters["cure_m_CM_to_RT"]), "age", "sdlog");
-  in.tableSecularTrendTreatment2008OR = TableDD(as<DataFrame>(tables["secularTrendTreatment2008OR"]),"year","OR");
-  in.tableOpportunisticBiopsyCompliance = TableBiopsyCompliance(as<DataFrame>(tables["biopsyOpportunisticComplianceTable"]),
-						"psa","age","compliance");
-  in.tableFormalBiopsyCompliance = TableBiopsyCompliance(as<DataFrame>(tables["biopsyFormalComplianceTable"]),
-						"psa","age","compliance");
-  in.rescreen_shape = TableDDD(as<DataFrame>(tables["rescreening"]), "age5", "total", "shape");
-  in.rescreen_scale = TableDDD(as<DataFrame>(tables["rescreening"]), "age5", "total", "scale");
-  in.rescreen_cure  = TableDDD(as<DataFrame>(tables["rescreening"]), "age5", "total", "cure");
-
-  in.H_dist.clear();
-  DataFrame df_survival_dist = as<DataFrame>(tables["survival_dist"]); // Grade,Time,Survival
-  DataFrame df_survival_local = as<DataFrame>(tables["survival_local"]); // Age,Grade,Time,Survival
-  // extract the columns from the survival_dist data-frame
-  IntegerVector sd_grades = df_survival_dist["Grade"];
-  NumericVector
-    sd_times = df_survival_dist["Time"],
-    sd_survivals = df_survival_dist["Survival"];
-  for (int i=0; i<sd_grades.size(); ++i)
-    in.H_dist[sd_grades[i]].push_back(Double(sd_times[i],-log(sd_survivals[i])));
-  for (H_dist_t::iterator it_sd = in.H_dist.begin(); it_sd != in.H_dist.end(); it_sd++)
-    it_sd->second.prepare();
-  // now we can use: H_dist[grade].invert(-log(u))
-  in.H_local.clear();
-  // extract the columns from the data-frame
-  IntegerVector sl_grades = df_survival_local["Grade"];
-  NumericVector
-    sl_ages = df_survival_local["Age"],
-    sl_times = df_survival_local["Time"],
-    sl_survivals = df_survival_local["Survival"];
-  // push to the map values and set of ages
-  for (int i=0; i<sl_grades.size(); ++i) {
-    in.H_local_age_set.insert(sl_ages[i]);
-    in.H_local[H_local_t::key_type(sl_ages[i],sl_grades[i])].push_back
-      (Double(sl_times[i],-log(sl_survivals[i])));
-  }
-  // prepare the map values for lookup
-  for (H_local_t::iterator it_sl = in.H_local.begin();
-       it_sl != in.H_local.end();
-       it_sl++)
-    it_sl->second.prepare();
-  // now we can use: H_local[H_local_t::key_type(*H_local_age_set.lower_bound(age),grade)].invert(-log(u))
-
+  int nthreads = parms.containsElementNamed("nthreads") ? as<int>(parms["nthreads"]) : 1;
+  bool profiling = parms.containsElementNamed("profile") && as<bool>(parms["profile"]);
+  string lifeHistoryFile = parms.containsElementNamed("lifeHistoryFile") ?
+    as<string>(parms["lifeHistoryFile"]) : string();
+  string checkpointFile = parms.containsElementNamed("checkpointFile") ?
+    as<string>(parms["checkpointFile"]) : string();
+  int checkpointEvery = parms.containsElementNamed("checkpointEvery") ? as<int>(parms["checkpointEvery"]) : n;
+  bool resume = parms.containsElementNamed("resume") && as<bool>(parms["resume"]);
+  bool keepInput = parms.containsElementNamed("keepInput") && as<bool>(parms["keepInput"]);
+  int first = parms.containsElementNamed("first") ? as<int>(parms["first"]) : 0;
+  int last = parms.containsElementNamed("last") ? as<int>(parms["last"]) : n;
+  string resultFile = parms.containsElementNamed("resultFile") ?
+    as<string>(parms["resultFile"]) : string();
+  vector<string> mergeFiles = parms.containsElementNamed("mergeFiles") ?
+    as<vector<string> >(parms["mergeFiles"]) : vector<string>();
+  if (first < 0 || last > n || first > last)
+    stop("the men to simulate are not in the population");
+  vector<double> precision = parms.containsElementNamed("precision") ?
+    as<vector<double> >(parms["precision"]) : vector<double>();
+  int batchSize = parms.containsElementNamed("batchSize") ? as<int>(parms["batchSize"]) : n;
+  if (!precision.empty() && precision.size() != size_t(Outcome::N))
+    stop("precision should have one target for each outcome");
+  vector<NumericVector> draws; // full parameter vectors
+  if (parms.containsElementNamed("draws") && !Rf_isNull(parms["draws"])) {
+    List drawList = parms["draws"];
+    for (int d = 0; d < drawList.size(); ++d)
+      draws.push_back(as<NumericVector>(drawList[d]));
+  }
   if (in.debug) {
-    Rprintf("SurvTime: %f\n",exp(-in.H_local[H_local_t::key_type(65.0,0)].approx(63.934032)));
-    Rprintf("SurvTime: %f\n",in.H_local[H_local_t::key_type(* in.H_local_age_set.lower_bound(65.0),0)].invert(-log(0.5)));
-    Rprintf("SurvTime: %f\n",exp(-in.H_dist[0].approx(5.140980)));
-    Rprintf("SurvTime: %f\n",in.H_dist[0].invert(-log(0.5)));
+    Rprintf("SurvTime: %f\n",exp(-in.H_local(65.0,0).approx(63.934032)));
+    Rprintf("SurvTime: %f\n",in.H_local.invert(65.0,0,-log(0.5)));
+    Rprintf("SurvTime: %f\n",exp(-in.H_dist(0.0,0).approx(5.140980)));
+    Rprintf("SurvTime: %f\n",in.H_dist.invert(0.0,0,-log(0.5)));
     // Rprintf("Biopsy compliance: %f\n",tableBiopsyCompliance(bounds<double>(1.0,4.0,10.0), bounds<double>(100.0,55,75)));
     Rprintf("Interp for grade 6/7 (expecting approx 0.3): %f\n",in.interp_prob_grade7.approx(0.143));
-    Rprintf("prtxCM(80,2008,1) [expecting 0.970711]: %f\n",in.prtxCM(80.0,2008.0,1));
+    Rprintf("prtxCM(80,2008,1) [expecting 0.970711]: %f\n",in.prtx(80.0,2008.0,1)[PrtxCM]);
     {
       double age_diag=51.0;
       ext::grade_t ext_grade = ext::Gleason_ge_8;
       // FhrcPerson person = FhcrcPerson(0,1960);
       // Rprintf("hr_localregional(50,0,)=%g\n",hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext_grade, person.psamean(age_diag)>10 ? 1 : 0));
-      Rprintf("hr_localregional(50,8+,0)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext_grade, 0));
-      Rprintf("hr_localregional(50,8+,1)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext_grade, 1));
-      Rprintf("hr_localregional(50,7,0)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext::Gleason_7, 0));
-      Rprintf("hr_localregional(50,7,1)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext::Gleason_7, 1));
-      Rprintf("hr_localregional(50,<=6,0)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext::Gleason_le_6, 0));
-      Rprintf("hr_localregional(50,<=6,1)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext::Gleason_le_6, 1));
-      Rprintf("screeningParticipation=%g\n",as<double>(in.parameter["screeningParticipation"]));
+      Rprintf("hr_localregional(50,8+,0)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext_grade, 0)[0]);
+      Rprintf("hr_localregional(50,8+,1)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext_grade, 1)[0]);
+      Rprintf("hr_localregional(50,7,0)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext::Gleason_7, 0)[0]);
+      Rprintf("hr_localregional(50,7,1)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext::Gleason_7, 1)[0]);
+      Rprintf("hr_localregional(50,<=6,0)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext::Gleason_le_6, 0)[0]);
+      Rprintf("hr_localregional(50,<=6,1)=%g\n",in.hr_locoregional(age_diag<50.0 ? 50.0 : age_diag, ext::Gleason_le_6, 1)[0]);
+      Rprintf("screeningParticipation=%g\n",in.parameter["screeningParticipation"]);
     }
   }
 
-  in.nLifeHistories = as<int>(otherParameters["nLifeHistories"]);
-  in.screen = as<int>(otherParameters["screen"]);
-  if (in.debug) Rprintf("screen=%i\n",in.screen);
-  in.panel = as<bool>(parms["panel"]);
-  NumericVector cohort = as<NumericVector>(parms["cohort"]); // at present, this is the only chuck-specific data
+  int nscreens = in.screens.size();
+  // the cohorts of the men, as (cohort, count) pairs
+  CohortSequence cohort;
+  NumericVector values = as<NumericVector>(parms["cohort"]);
+  NumericVector counts = as<NumericVector>(parms["cohortCounts"]);
+  if (values.size() != counts.size())
+    stop("cohort and cohortCounts should have the same length");
+  if (values.size() > 0)
+    cohort = CohortSequence(&values[0], &counts[0], values.size());
+  if (cohort.size() < n)
+    stop("fewer cohorts than men");
+  // with precision targets, interleave the men across the cohorts
+  if (!precision.empty())
+    cohort.interleave();
+  if (!cohort.values.empty())
+    in.fullStates = FullState::Codes(&cohort.values[0], &cohort.values[0] + cohort.values.size());
 
 
   // set up the parameters
-  double ages0[106];
-  boost::algorithm::iota(ages0, ages0+106, 0.0);
-  in.rmu0 = Rpexp(&mu0[0], ages0, 106);
   vector<double> ages(101);
   boost::algorithm::iota(ages.begin(), ages.end(), 0.0);
   ages.push_back(1.0e+6);
 
-  // re-set the output objects
-  out.report.clear();
-  out.shortReport.clear();
-  out.costs.clear();
-  out.outParameters.clear();
-  out.lifeHistories.clear();
-  out.psarecord.clear();
-  out.bxrecord.clear();
-  out.falsePositives.clear();
-  out.diagnoses.clear();
-
-  out.report.discountRate = in.parameter["discountRate.effectiveness"];
-  out.report.setPartition(ages);
-  out.shortReport.discountRate = in.parameter["discountRate.effectiveness"];
-  out.shortReport.setPartition(ages);
-  out.costs.discountRate = in.parameter["discountRate.costs"];
-  out.costs.setPartition(ages);
-
-  // main loop
-  FhcrcPerson person(&in, &out, &utilities, 1, 2000);
-  for (int i = 0; i < n; ++i) {
-    person = FhcrcPerson(&in, &out, &utilities, i+firstId, cohort[i]);
-    Sim::create_process(&person);
-    Sim::run_simulation();
-    Sim::clear();
-    in.rngNh->nextSubstream();
-    in.rngOther->nextSubstream();
-    in.rngScreen->nextSubstream();
-    in.rngTreatment->nextSubstream();
-    R_CheckUserInterrupt();  /* be polite -- did the user hit ctrl-C? */
-  }
-
-  // output
-  // TODO: clean up these objects in C++ (cf. R)
-  return List::create(_("costs") = out.costs.wrap(),                // CostReport
-		      _("summary") = out.report.wrap(),             // EventReport
-		      _("shortSummary") = out.shortReport.wrap(),   // EventReport
-		      _("lifeHistories") = wrap(out.lifeHistories), // vector<LifeHistory::Type>
-		      _("parameters") = out.outParameters.wrap(),   // SimpleReport<double>
-		      _("psarecord")=out.psarecord.wrap(),          // SimpleReport<double>
-		      _("bxrecord")=out.bxrecord.wrap(),            // SimpleReport<double>
-		      _("falsePositives")=out.falsePositives.wrap(),// SimpleReport<double>
-		      _("diagnoses")=out.diagnoses.wrap(),          // SimpleReport<double>
-		      _("tmc_minus_t0")=out.tmc_minus_t0.wrap()     // Means
-		      );
+  // Rprintf is not thread-safe
+  if (in.debug || nthreads < 1) nthreads = 1;
+#ifndef _OPENMP
+  nthreads = 1;
+#endif
+
+  // re-set the output objects, one per worker and scenario: outs[t*nscreens + k]
+  vector<SimOutput> outs(nthreads * nscreens);
+  for (size_t t = 0; t < outs.size(); ++t)
+    setupOutput(outs[t], in, ages, profiling);
+
+  // the run, for the checkpoint and result files
+  CheckpointHeader run(in, n, first, last, cohort);
+
+  // merge the results of earlier runs on parts of the population?
+  if (!mergeFiles.empty()) {
+    vector<pair<int,int> > slices; // men first, ..., nextMan-1 of each file
+    for (size_t i = 0; i < mergeFiles.size(); ++i) {
+      vector<SimOutput> part(nscreens);
+      for (int k = 0; k < nscreens; ++k)
+	setupOutput(part[k], in, ages, profiling);
+      CheckpointHeader slice;
+      if (!readCheckpoint(mergeFiles[i], run, false, slice, part))
+	stop("cannot read checkpoint file " + mergeFiles[i]);
+      slices.push_back(make_pair(int(slice.first), int(slice.nextMan)));
+      for (int k = 0; k < nscreens; ++k)
+	outs[k].append(part[k]);
+    }
+    // the slices should cover the men once
+    sort(slices.begin(), slices.end());
+    int covered = 0;
+    for (size_t i = 0; i < slices.size(); ++i) {
+      if (slices[i].first != covered)
+	stop(slices[i].first < covered ? "the merged slices overlap" : "the merged slices miss some men");
+      covered = slices[i].second;
+    }
+    if (covered != n)
+      stop("the merged slices miss some men");
+    first = last; // nothing left to simulate
+  }
+
+  // check the scenario and model choices here: the workers cannot report errors
+  for (int k = 0; k < nscreens; ++k)
+    if (in.screens[k] < noScreening || in.screens[k] > stopped_screening)
+      stop("screening scenario not matched");
+  if (in.par.biomarker_model != random_correction && in.par.biomarker_model != psa_informed_correction)
+    stop("parameter biomarker_model not matched");
+  if (in.par.c_benefit_type != StageShiftBased && in.par.c_benefit_type != LeadTimeBased)
+    stop("parameter c_benefit_type not matched");
+
+  // stream the life histories to a file?
+  LifeHistoryFile lifeHistoryStream; // closed by the destructor if we stop
+  if (!lifeHistoryFile.empty()) {
+    if (nscreens > 1)
+      stop("lifeHistoryFile is not available for several scenarios");
+    if (!checkpointFile.empty())
+      stop("lifeHistoryFile is not available with checkpoints");
+    if (!draws.empty())
+      stop("lifeHistoryFile is not available with draws");
+    if (!lifeHistoryStream.open(lifeHistoryFile))
+      stop("cannot write life history file " + lifeHistoryFile);
+    for (int t = 0; t < nthreads; ++t)
+      outs[t].lifeHistorySink.file = &lifeHistoryStream;
+  }
+
+  // probabilistic sensitivity analysis: simulate the same men for each
+  // parameter draw, keeping only the outcome means by draw and scenario
+  if (!draws.empty()) {
+    vector<int> drawIndex, screenIndex;
+    vector<double> men;
+    vector<vector<double> > sums(Outcome::N), sumsqs(Outcome::N);
+    for (size_t d = 0; d < draws.size(); ++d) {
+      in.parameter = NamedNumeric(draws[d]);
+      in.par.resolve(in.parameter, in.bparameter);
+      setPolicies(in);
+      for (size_t t = 0; t < outs.size(); ++t)
+	setupOutput(outs[t], in, ages, profiling);
+      if (runBlocks(in, outs, nthreads, nscreens, first, last, 0, (last - first + blockSize - 1) / blockSize,
+		    0, cohort, firstId))
+	stop("callFhcrc interrupted");
+      mergeOutputs(outs, nthreads, nscreens, false);
+      for (int k = 0; k < nscreens; ++k) {
+	drawIndex.push_back(d + 1);
+	screenIndex.push_back(in.screens[k]);
+	men.push_back(double(outs[k].outcomesTotal[0].n));
+	for (int j = 0; j < Outcome::N; ++j) {
+	  sums[j].push_back(outs[k].outcomesTotal[j].sum.value());
+	  sumsqs[j].push_back(outs[k].outcomesTotal[j].sumsq.value());
+	}
+      }
+    }
+    List sum, sumsq;
+    for (int j = 0; j < Outcome::N; ++j) {
+      sum.push_back(Rcpp::wrap(sums[j]), Outcome::names[j]);
+      sumsq.push_back(Rcpp::wrap(sumsqs[j]), Outcome::names[j]);
+    }
+    return List::create(_("draw") = Rcpp::wrap(drawIndex),
+			_("screen") = Rcpp::wrap(screenIndex),
+			_("n") = Rcpp::wrap(men),
+			_("sum") = sum,
+			_("sumsq") = sumsq);
+  }
+
+  // main loop: the workers take blocks of men from a shared queue. With
+  // a checkpoint file, the results are merged and saved after every
+  // checkpointEvery men (rounded up to whole blocks).
+  int nblocks = (last - first + blockSize - 1) / blockSize;
+  int firstBlock = 0;
+  if (resume && !checkpointFile.empty()) {
+    CheckpointHeader saved;
+    bool found = false;
+    if (fileExists(checkpointFile)) {
+      if (!readCheckpoint(checkpointFile, run, true, saved, outs))
+	stop("cannot read checkpoint file " + checkpointFile);
+      found = true;
+    }
+    else if (fileExists(checkpointFile + ".tmp")) {
+      // stopped while the file was replaced: use the new file if it is complete
+      found = readCheckpoint(checkpointFile + ".tmp", run, true, saved, outs);
+      if (!found)
+	for (int k = 0; k < nscreens; ++k)
+	  outs[k].clearResults();
+    }
+    if (found)
+      firstBlock = (saved.nextMan - first + blockSize - 1) / blockSize;
+  }
+  int roundBlocks = checkpointFile.empty() ? nblocks : max(1, (checkpointEvery + blockSize - 1) / blockSize);
+  // with precision targets, check the targets after every batchSize men
+  if (!precision.empty())
+    roundBlocks = min(roundBlocks, max(1, (batchSize + blockSize - 1) / blockSize));
+  bool interrupted = false, reached = false;
+  // a checkpoint at which the precision targets were met ends the run
+  if (firstBlock > 0 && !precision.empty() && precisionReached(outs, nthreads, nscreens, precision)) {
+    reached = true;
+    last = min(last, first + firstBlock*blockSize);
+  }
+  for (int round = firstBlock; round < nblocks && !interrupted && !reached; round += roundBlocks) {
+    int lastBlock = min(nblocks, round + roundBlocks);
+    // reserve the records only when starting from empty results
+    int expectedMen = (round == 0) ? (last - first) / nthreads + 1 : 0;
+    interrupted = runBlocks(in, outs, nthreads, nscreens, first, last, round, lastBlock,
+			    expectedMen, cohort, firstId);
+    if (!checkpointFile.empty() && !interrupted) {
+      mergeOutputs(outs, nthreads, nscreens, false);
+      run.nextMan = min(last, first + lastBlock*blockSize);
+      writeCheckpoint(checkpointFile, run, outs);
+    }
+    if (!precision.empty() && !interrupted && precisionReached(outs, nthreads, nscreens, precision)) {
+      reached = true;
+      last = min(last, first + lastBlock*blockSize);
+    }
+  }
+  if (lifeHistoryStream.isOpen() && !lifeHistoryStream.close() && !interrupted)
+    stop("error writing life history file " + lifeHistoryFile);
+  if (interrupted) stop("callFhcrc interrupted");
+  for (size_t t = 0; t < outs.size(); ++t)
+    if (outs[t].unknownKind >= 0) {
+      char message[64];
+      sprintf(message, "no valid kind of event: %i", int(outs[t].unknownKind));
+      stop(message);
+    }
+
+  // merge the workers' results for each scenario
+  mergeOutputs(outs, nthreads, nscreens, true);
+  if (!resultFile.empty()) {
+    run.nextMan = last;
+    writeCheckpoint(resultFile, run, outs);
+  }
+
+  // output: the merged results, as a list by scenario if there are several,
+  // with the cohorts of the men in the results and the input handle if it
+  // is to be reused
+  List cohorts = mergeFiles.empty() ? cohort.counts(run.first, last) : cohort.counts(0, n);
+  if (nscreens == 1) {
+    List result = outs[0].wrap(in.fullStates);
+    result.push_back(Rcpp::wrap(nthreads), "threads");
+    result.push_back(cohorts, "cohorts");
+    if (keepInput) result.push_back(input, "input");
+    return result;
+  }
+  List result;
+  for (int k = 0; k < nscreens; ++k) {
+    List arm = outs[k].wrap(in.fullStates);
+    arm.push_back(Rcpp::wrap(nthreads), "threads");
+    arm.push_back(cohorts, "cohorts");
+    if (keepInput) arm.push_back(input, "input");
+    result.push_back(arm);
+  }
+  return result;
+
+  END_RCPP
 }
 
+  /**
+     @brief Micro-benchmarks for the natural history and table lookups, using
+     an input handle from callFhcrc(..., keepInput=TRUE). Returns the
+     nanoseconds per call for each function, evaluated at the natural
+     histories of the first men of the run.
+  */
+  RcppExport SEXP callFhcrcBenchmark(SEXP parmsIn) {
+
+    BEGIN_RCPP
+
+    List parms(parmsIn);
+    SEXP handle = parms["input"];
+    XPtr<SimInput> input(handle);
+    SimInput* in = input.checked_get();
+    int men = 1000;
+    int repeats = max(1, as<int>(parms["iterations"]) / men); // calls per man
+
+    SimOutput out;
+    Utilities utilities(in->par.utility_scale, in->par.utility_truncate, in->par.utility_background_analytic);
+    EventQueue queue;
+    WorkerRng rng(*in);
+    vector<NaturalHistory> histories(men);
+    FhcrcPerson person(in, &out, &utilities, &queue, &rng, 0, 1960);
+    rng.seek(0);
+    for (int i = 0; i < men; ++i) {
+      person.sampleNaturalHistory();
+      histories[i] = person.naturalHistory();
+      rng.nextSubstream();
+    }
+    vector<double> u(men);
+    for (int i = 0; i < men; ++i)
+      u[i] = rng.unif_rand();
+    for (int k = 0; k < 4; ++k)
+      utilities.add(k, 0.8 + 0.05 * k);
+
+    vector<string> names;
+    vector<double> ns;
+    double sink = 0.0; // keep the results live
+    double start;
+
+#define FHCRC_BENCHMARK(NAME, SETUP, EXPR)				\
+    start = wall_time();						\
+    for (int i = 0; i < men; ++i) {					\
+      SETUP;								\
+      for (int r = 0; r < repeats; ++r)					\
+	sink += (EXPR);							\
+    }									\
+    names.push_back(NAME);						\
+    ns.push_back((wall_time() - start) * 1.0e9 / (double(men) * repeats))
+
+#define FHCRC_SET_PERSON						\
+    person.setNaturalHistory(histories[i]);				\
+    person.grade = person.future_grade;					\
+    person.ext_grade = person.future_ext_grade;				\
+    person.ext_state = ext::T1_T2
+
+    FHCRC_BENCHMARK("calculate_survival", FHCRC_SET_PERSON,
+		    person.calculate_survival(u[i], 65.0, 66.0, RP));
+    FHCRC_BENCHMARK("calculate_transition_time", FHCRC_SET_PERSON,
+		    person.calculate_transition_time(u[i], person.t0, in->par.g3p));
+    FHCRC_BENCHMARK("prtx", (void) 0,
+		    in->prtx(50.0 + 29.0 * u[i], 2008.0, int(histories[i].future_grade))[PrtxCM]);
+    FHCRC_BENCHMARK("rescreen", (void) 0,
+		    in->rescreen(30.0 + 60.0 * u[i], 10.0 * u[i])[RescreenShape]);
+    FHCRC_BENCHMARK("hr_locoregional", (void) 0,
+		    in->hr_locoregional(50.0 + 30.0 * u[i], histories[i].future_ext_grade, i % 2)[0]);
+    FHCRC_BENCHMARK("production", (void) 0, in->production(30.0 + 60.0 * u[i]));
+    FHCRC_BENCHMARK("utility", (void) 0, utilities.utility(30.0 + 60.0 * u[i]));
+
+#undef FHCRC_SET_PERSON
+#undef FHCRC_BENCHMARK
+
+    NumericVector result(ns.begin(), ns.end());
+    result.attr("names") = Rcpp::wrap(names);
+    result.attr("sink") = sink;
+    return result;
+
+    END_RCPP
+  }
+
 } // anonymous namespace
@@ -0,0 +1,6 @@
+#!/bin/bash
+#PBS -o CLUSTER
+#PBS -j oe
+module load Apps/R
+cd $PBS_O_WORKDIR
+mpirun Rscript cluster_slices.R run && Rscript cluster_slices.R merge